@@ -0,0 +1,531 @@
+// Benchmarks of gc workloads, each one compared with the same workload on `std::shared_ptr`.
+//
+// Usage: tgc_bench [--json] [--record prefix] [workload...]
+//   --json    prints one JSON object per line instead of a table, for regression tracking
+//   --record  records the allocation trace of every tgc2 run into `<prefix><workload>.trace`,
+//             see `tgc_replay`
+//   workload names select a subset (all by default), `random_graph_mark` times the mark phase
+//   of a randomly laid out graph of 256K and 4M nodes on tgc2 only
+// The peak RSS includes the memory kept by the allocators after the previous workloads, run one
+// workload per process to compare it.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+// after windows.h
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "tgc2.h"
+
+using namespace tgc2;
+using namespace std;
+using Clock = chrono::steady_clock;
+
+//////////////////////////////////////////////////////////////////////////
+// Implementations, workloads are templates over them.
+
+// The heap collects every `CollectPeriod` allocations, with a full collection every `FullPeriod`
+// collections so the results do not depend on timing.
+constexpr size_t CollectPeriod = 64 * 1024, FullPeriod = 8;
+size_t allocCnt = 0;
+
+struct PeriodicCondition : details::GcCondition {
+    size_t allocCnt = 0, collectCnt = 0;
+
+    bool needMinorGc(details::Collector* c) override { return ++allocCnt % CollectPeriod == 0; }
+    bool needFullGc(details::Collector* c) override { return ++collectCnt % FullPeriod == 0; }
+};
+
+struct GcImpl {
+    static constexpr const char* name = "tgc2";
+
+    template <typename T> using Ptr = gc<T>;
+    template <typename T> using WeakPtr = gc<T>; // cycles are collected
+    template <typename T> using Vector = gc_vector<T>;
+    template <typename K, typename V> using Map = gc_map<K, V>;
+    template <typename F> using Function = gc_function<F>;
+    using Doubles = gc<double>;
+
+    template <typename T, typename... A> static Ptr<T> make(A&&... a) {
+        allocated(1);
+        return gc_new<T>(std::forward<A>(a)...);
+    }
+    template <typename T> static Vector<T> makeVector() {
+        allocated(1);
+        return gc_new_vector<T>();
+    }
+    template <typename K, typename V> static Map<K, V> makeMap() {
+        allocated(1);
+        return gc_new_map<K, V>();
+    }
+    template <typename T> static T& lock(const WeakPtr<T>& p) { return *p; }
+    static Doubles makeDoubles(size_t n) {
+        allocated(1);
+        return gc_new_array<double>(n);
+    }
+    static double* data(const Doubles& d) { return &*d; }
+
+    static void allocated(size_t n) { allocCnt += n; }
+};
+
+struct SharedImpl {
+    static constexpr const char* name = "shared_ptr";
+
+    template <typename T> using Ptr = shared_ptr<T>;
+    template <typename T> using WeakPtr = weak_ptr<T>; // breaks the cycles
+    template <typename T> using Vector = shared_ptr<vector<shared_ptr<T>>>;
+    template <typename K, typename V> using Map = shared_ptr<map<K, weak_ptr<V>>>;
+    template <typename F> using Function = function<F>;
+    using Doubles = shared_ptr<double[]>;
+
+    template <typename T, typename... A> static Ptr<T> make(A&&... a) {
+        allocCnt++;
+        return make_shared<T>(std::forward<A>(a)...);
+    }
+    template <typename T> static Vector<T> makeVector() {
+        allocCnt++;
+        return make_shared<vector<shared_ptr<T>>>();
+    }
+    template <typename K, typename V> static Map<K, V> makeMap() {
+        allocCnt++;
+        return make_shared<map<K, weak_ptr<V>>>();
+    }
+    template <typename T> static T& lock(const WeakPtr<T>& p) { return *p.lock(); }
+    static Doubles makeDoubles(size_t n) {
+        allocCnt++;
+        return Doubles(new double[n]);
+    }
+    static double* data(const Doubles& d) { return d.get(); }
+
+    static void allocated(size_t n) { allocCnt += n; }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Workloads, each one returns a checksum so nothing is optimized away.
+
+// GCBench: short-lived binary trees built top-down and bottom-up next to a long-lived tree
+// and a long-lived array.
+template <typename I> struct TreeNode {
+    typename I::template Ptr<TreeNode> left, right;
+    int i = 0, j = 0;
+};
+
+template <typename I> void populate(int depth, typename I::template Ptr<TreeNode<I>> node) {
+    if (depth-- <= 0)
+        return;
+    node->left = I::template make<TreeNode<I>>();
+    node->right = I::template make<TreeNode<I>>();
+    populate<I>(depth, node->left);
+    populate<I>(depth, node->right);
+}
+
+template <typename I> typename I::template Ptr<TreeNode<I>> makeTree(int depth) {
+    auto node = I::template make<TreeNode<I>>();
+    if (depth > 0) {
+        node->left = makeTree<I>(depth - 1);
+        node->right = makeTree<I>(depth - 1);
+    }
+    return node;
+}
+
+template <typename I> size_t binaryTrees() {
+    constexpr int StretchDepth = 18, LongLivedDepth = 16, MinDepth = 4, MaxDepth = 16;
+    constexpr size_t ArraySize = 500000;
+    auto treeSize = [](int depth) { return (size_t(1) << (depth + 1)) - 1; };
+
+    size_t sum = 0;
+    sum += makeTree<I>(StretchDepth)->i;
+
+    auto longLived = I::template make<TreeNode<I>>();
+    populate<I>(LongLivedDepth, longLived);
+    auto array = I::makeDoubles(ArraySize);
+    for (size_t i = 0; i < ArraySize / 2; i++)
+        I::data(array)[i] = 1.0 / (i + 1);
+
+    for (int depth = MinDepth; depth <= MaxDepth; depth += 2) {
+        auto iterations = 2 * treeSize(StretchDepth) / treeSize(depth);
+        for (size_t i = 0; i < iterations; i++) {
+            auto top = I::template make<TreeNode<I>>();
+            populate<I>(depth, top);
+            sum += top->left->i;
+            sum += makeTree<I>(depth)->j;
+        }
+    }
+    return sum + longLived->left->i + (size_t)I::data(array)[1000];
+}
+
+// Long singly linked lists built, walked and dropped.
+template <typename I> struct ListNode {
+    typename I::template Ptr<ListNode> next;
+    size_t value = 0;
+};
+
+template <typename I> size_t linkedLists() {
+    constexpr size_t Length = 200000, Rounds = 10;
+    size_t sum = 0;
+    for (size_t r = 0; r < Rounds; r++) {
+        typename I::template Ptr<ListNode<I>> head;
+        for (size_t i = 0; i < Length; i++) {
+            auto node = I::template make<ListNode<I>>();
+            node->value = i;
+            node->next = head;
+            head = node;
+        }
+        for (auto* n = &*head; n; n = n->next ? &*n->next : nullptr)
+            sum += n->value;
+        // A long list is released recursively by `shared_ptr`, unlink it first.
+        while (head)
+            head = typename I::template Ptr<ListNode<I>>(head->next);
+    }
+    return sum;
+}
+
+// Graphs of nodes kept in a vector, with edges in a map of every node.
+template <typename I> struct GraphNode {
+    typename I::template Map<int, GraphNode> edges = I::template makeMap<int, GraphNode>();
+    int id = 0;
+};
+
+template <typename I> size_t containerGraphs() {
+    constexpr int NodeCnt = 20000, EdgeCnt = 8, Rounds = 5;
+    mt19937 rng(42);
+    size_t sum = 0;
+    for (int r = 0; r < Rounds; r++) {
+        auto nodes = I::template makeVector<GraphNode<I>>();
+        for (int i = 0; i < NodeCnt; i++) {
+            nodes->push_back(I::template make<GraphNode<I>>());
+            nodes->back()->id = i;
+        }
+        for (auto& node : *nodes) {
+            for (int e = 0; e < EdgeCnt; e++)
+                (*node->edges)[e] = (*nodes)[rng() % NodeCnt];
+        }
+        for (auto& node : *nodes) {
+            for (auto& edge : *node->edges)
+                sum += I::lock(edge.second).id;
+        }
+    }
+    return sum;
+}
+
+// Small rings dropped right away, `shared_ptr` needs a weak pointer to release them.
+template <typename I> struct RingNode {
+    typename I::template Ptr<RingNode> next;
+    typename I::template WeakPtr<RingNode> first;
+    int value = 0;
+};
+
+template <typename I> size_t cycles() {
+    constexpr int RingCnt = 200000, RingSize = 4;
+    size_t sum = 0;
+    for (int r = 0; r < RingCnt; r++) {
+        auto first = I::template make<RingNode<I>>();
+        auto last = first;
+        for (int i = 1; i < RingSize; i++) {
+            last->next = I::template make<RingNode<I>>();
+            last = last->next;
+            last->value = i;
+        }
+        last->first = first;
+        sum += I::lock(last->first).value + last->value;
+    }
+    return sum;
+}
+
+// Short-lived callbacks capturing a pointer, called once and dropped.
+template <typename I> size_t callbacks() {
+    constexpr int CallbackCnt = 1000000;
+    size_t sum = 0;
+    for (int i = 0; i < CallbackCnt; i++) {
+        auto payload = I::template make<int>(i);
+        typename I::template Function<int()> f = [payload] { return *payload; };
+        // `gc_function` allocates the closure, `std::function` may store it inline.
+        I::allocated(1);
+        sum += f();
+    }
+    return sum;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Measurement
+
+// Collects the pauses of the collections of the benchmarked heap.
+struct PauseRecorder : details::GcListener {
+    details::PauseHistogram minor, full;
+
+    void onEnd(details::Collector* c, const details::GcEvent& e) override {
+        if (e.phase == details::GcEvent::Phase::None)
+            (e.kind == details::GcEvent::Kind::Minor ? minor : full).record(e.duration);
+    }
+};
+
+// Peak resident set size since the last `resetPeakRss` (since the start of the process
+// where it can not be reset), in KB.
+size_t peakRssKb() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return pmc.PeakWorkingSetSize / 1024;
+    return 0;
+#elif defined(__linux__)
+    if (auto* f = fopen("/proc/self/status", "r")) {
+        char line[256];
+        size_t kb = 0;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %zu kB", &kb) == 1)
+                break;
+        }
+        fclose(f);
+        return kb;
+    }
+    return 0;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+void resetPeakRss() {
+#if defined(_WIN32)
+    // Trims the working set, the peak is not reset.
+    SetProcessWorkingSetSize(GetCurrentProcess(), (SIZE_T)-1, (SIZE_T)-1);
+#elif defined(__linux__)
+    if (auto* f = fopen("/proc/self/clear_refs", "w")) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+struct Result {
+    const char* workload;
+    const char* impl;
+    double seconds = 0;
+    size_t allocations = 0;
+    details::PauseHistogram minor{}, full{};
+    size_t peakRssKb = 0;
+    size_t checksum = 0;
+};
+
+const char* recordPrefix = nullptr;
+
+template <typename I> Result run(const char* workload, size_t (*body)()) {
+    Result r{workload, I::name};
+    allocCnt = 0;
+    auto* heap = gc_create_heap();
+    auto* pauses = new PauseRecorder;
+    heap->setListener(pauses);
+    heap->setGcCondition(new PeriodicCondition);
+    if (recordPrefix && is_same_v<I, GcImpl>) {
+        auto path = string(recordPrefix) + workload + ".trace";
+        if (!heap->startRecording(path.c_str()))
+            fprintf(stderr, "unable to record '%s'\n", path.c_str());
+    }
+    {
+        gc_heap_scope scope(heap);
+        resetPeakRss();
+        auto start = Clock::now();
+        r.checksum = body();
+        r.seconds = chrono::duration<double>(Clock::now() - start).count();
+        r.peakRssKb = peakRssKb();
+        r.allocations = allocCnt;
+    }
+    if (recordPrefix && is_same_v<I, GcImpl> && !heap->stopRecording())
+        fprintf(stderr, "unable to write the trace of '%s'\n", workload);
+    r.minor = pauses->minor;
+    r.full = pauses->full;
+    gc_destroy_heap(heap);
+    return r;
+}
+
+double toUs(chrono::nanoseconds d) { return d.count() / 1e3; }
+
+void printTableHeader() {
+    printf(
+        "%-18s %-10s %9s %10s %6s %9s %9s %6s %9s %9s %9s\n",
+        "workload",
+        "impl",
+        "time(ms)",
+        "Malloc/s",
+        "minors",
+        "p99(us)",
+        "max(us)",
+        "fulls",
+        "p99(us)",
+        "max(us)",
+        "RSS(MB)");
+}
+
+void printRow(const Result& r) {
+    printf(
+        "%-18s %-10s %9.1f %10.2f %6zu %9.1f %9.1f %6zu %9.1f %9.1f %9.1f\n",
+        r.workload,
+        r.impl,
+        r.seconds * 1e3,
+        r.allocations / r.seconds / 1e6,
+        r.minor.count(),
+        toUs(r.minor.percentile(0.99)),
+        toUs(r.minor.max()),
+        r.full.count(),
+        toUs(r.full.percentile(0.99)),
+        toUs(r.full.max()),
+        r.peakRssKb / 1024.0);
+}
+
+void printJson(const Result& r) {
+    auto pauses = [](const char* kind, const details::PauseHistogram& h) {
+        printf(
+            ",\"%s_count\":%zu,\"%s_p50_us\":%.3f,\"%s_p99_us\":%.3f,\"%s_max_us\":%.3f,\"%s_total_us\":%.3f",
+            kind,
+            h.count(),
+            kind,
+            toUs(h.percentile(0.5)),
+            kind,
+            toUs(h.percentile(0.99)),
+            kind,
+            toUs(h.max()),
+            kind,
+            toUs(h.total()));
+    };
+    printf(
+        "{\"workload\":\"%s\",\"impl\":\"%s\",\"seconds\":%.6f,\"allocations\":%zu,\"allocs_per_sec\":%.0f",
+        r.workload,
+        r.impl,
+        r.seconds,
+        r.allocations,
+        r.allocations / r.seconds);
+    pauses("minor", r.minor);
+    pauses("full", r.full);
+    printf(",\"peak_rss_kb\":%zu,\"checksum\":%zu}\n", r.peakRssKb, r.checksum);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Mark phase on a graph laid out at random: `left` chains the nodes in shuffled allocation order,
+// `right` points to a random node. Reports the best mark phase of 5 full collections with the
+// sweep in the background, tgc2 only.
+
+struct MarkNode {
+    gc<MarkNode> left, right;
+};
+
+struct MarkTimer : details::GcListener {
+    chrono::nanoseconds mark{0};
+
+    void onEnd(details::Collector* c, const details::GcEvent& e) override {
+        if (e.phase == details::GcEvent::Phase::Mark)
+            mark = e.duration;
+    }
+};
+
+void randomGraphMark(size_t cnt, bool json) {
+    auto* heap = gc_create_heap();
+    auto* timer = new MarkTimer;
+    heap->setListener(timer);
+    heap->setBackgroundSweep(true);
+    auto best = chrono::nanoseconds::max();
+    {
+        gc_heap_scope scope(heap);
+        mt19937 rng(42);
+        vector<gc<MarkNode>> nodes(cnt);
+        for (auto& n : nodes)
+            n = gc_new<MarkNode>();
+        vector<size_t> order(cnt);
+        for (size_t i = 0; i < cnt; i++)
+            order[i] = i;
+        shuffle(order.begin(), order.end(), rng);
+        for (size_t i = 0; i + 1 < cnt; i++)
+            nodes[order[i]]->left = nodes[order[i + 1]];
+        for (auto& n : nodes)
+            n->right = nodes[rng() % cnt];
+        gc<MarkNode> head = nodes[order[0]];
+        nodes = {};
+
+        for (int i = 0; i < 5; i++) {
+            heap->fullCollect();
+            best = min(best, timer->mark);
+        }
+    }
+    gc_destroy_heap(heap);
+
+    double seconds = chrono::duration<double>(best).count();
+    if (json)
+        printf(
+            "{\"workload\":\"random_graph_mark\",\"impl\":\"tgc2\",\"nodes\":%zu,\"mark_seconds\":%.6f,"
+            "\"nodes_per_sec\":%.0f}\n",
+            cnt,
+            seconds,
+            cnt / seconds);
+    else
+        printf(
+            "%-18s %-10s %9.1f %10.2f   (mark phase, Mnodes/s, %zu nodes)\n",
+            "random_graph_mark",
+            "tgc2",
+            seconds * 1e3,
+            cnt / seconds / 1e6,
+            cnt);
+}
+
+int main(int argc, char** argv) {
+    struct Workload {
+        const char* name;
+        size_t (*gc)();
+        size_t (*shared)();
+    };
+    const Workload workloads[] = {
+        {"binary_trees", binaryTrees<GcImpl>, binaryTrees<SharedImpl>},
+        {"linked_lists", linkedLists<GcImpl>, linkedLists<SharedImpl>},
+        {"container_graphs", containerGraphs<GcImpl>, containerGraphs<SharedImpl>},
+        {"cycles", cycles<GcImpl>, cycles<SharedImpl>},
+        {"callbacks", callbacks<GcImpl>, callbacks<SharedImpl>},
+    };
+
+    bool json = false;
+    vector<string> selected;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json"))
+            json = true;
+        else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+            recordPrefix = argv[++i];
+        else
+            selected.push_back(argv[i]);
+    }
+
+    if (!json)
+        printTableHeader();
+    for (auto& w : workloads) {
+        if (selected.size() && find(selected.begin(), selected.end(), w.name) == selected.end())
+            continue;
+        for (auto& r : {run<GcImpl>(w.name, w.gc), run<SharedImpl>(w.name, w.shared)}) {
+            if (json)
+                printJson(r);
+            else
+                printRow(r);
+            fflush(stdout);
+        }
+    }
+    if (selected.empty() || find(selected.begin(), selected.end(), "random_graph_mark") != selected.end()) {
+        for (size_t cnt : {256 * 1024, 4 * 1024 * 1024}) {
+            randomGraphMark(cnt, json);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
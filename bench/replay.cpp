@@ -0,0 +1,231 @@
+// Replays an allocation trace recorded by `Collector::startRecording` on a fresh heap.
+//
+// Usage: tgc_replay <trace> [--json] [--mark-threads n] [--background-sweep]
+//
+// Every recorded object is replaced by an array of pointer slots of about the same size, where
+// a sub pointer takes the slot at its offset. Roots and container elements are kept in a map
+// by their recorded address, and the recorded collections run at the same points of the trace.
+// Container elements stay roots until destroyed, so the replayed heap may keep more objects.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#include "tgc2.h"
+
+using namespace tgc2;
+using namespace std;
+using details::AllocTraceEvent;
+using Clock = chrono::steady_clock;
+
+struct Slot {
+    gc<Slot> p;
+};
+
+struct Object {
+    details::ObjMeta* meta;
+    Slot* slots;
+    size_t slotCnt;
+};
+
+// Collects the pauses and the peak live bytes of the replayed heap.
+struct ReplayListener : details::GcListener {
+    details::PauseHistogram minor, full;
+    size_t peakLive = 0;
+
+    void onBegin(details::Collector* c, const details::GcEvent& e) override {
+        if (e.phase == details::GcEvent::Phase::None && e.live.bytes > peakLive)
+            peakLive = e.live.bytes;
+    }
+    void onEnd(details::Collector* c, const details::GcEvent& e) override {
+        if (e.phase == details::GcEvent::Phase::None)
+            (e.kind == details::GcEvent::Kind::Minor ? minor : full).record(e.duration);
+    }
+};
+
+struct Replay {
+    unordered_map<uint64_t, Object> objects;
+    unordered_map<uint64_t, gc<Slot>> constructing; // keeps the objects alive like `creatingObjs`
+    unordered_map<uint64_t, gc<Slot>> roots;
+    unordered_map<uint64_t, gc<Slot>*> subPtrs;
+    size_t events = 0, classes = 0, allocations = 0, stores = 0, collections = 0;
+    size_t unknownPtrs = 0; // stored but created before the recording
+
+    // Pointers of the heap are destroyed before it.
+    void clear() {
+        constructing.clear();
+        roots.clear();
+        subPtrs.clear();
+        objects.clear();
+    }
+
+    gc<Slot>* findPtr(uint64_t ptr) {
+        auto r = roots.find(ptr);
+        if (r != roots.end())
+            return &r->second;
+        auto s = subPtrs.find(ptr);
+        return s != subPtrs.end() ? s->second : nullptr;
+    }
+
+    void apply(const AllocTraceEvent& e) {
+        using Type = AllocTraceEvent::Type;
+        events++;
+        switch (e.type) {
+        case Type::Class:
+            classes++;
+            break;
+        case Type::Alloc: {
+            auto bytes = e.size * e.length;
+            auto cnt = max<size_t>(1, (bytes + sizeof(Slot) - 1) / sizeof(Slot));
+            auto p = gc_new_array<Slot>(cnt);
+            objects[e.obj] = Object{p.getMeta(), &*p, cnt};
+            constructing[e.obj] = p;
+            allocations++;
+            break;
+        }
+        case Type::Constructed:
+            constructing.erase(e.obj);
+            break;
+        case Type::NewPtr:
+            if (!e.obj) {
+                subPtrs.erase(e.ptr);
+                roots[e.ptr] = nullptr;
+            } else {
+                // Pointers are at least `sizeof(Slot)` apart, so every one gets its own slot.
+                auto o = objects.find(e.obj);
+                if (o != objects.end())
+                    subPtrs[e.ptr] = &o->second.slots[min(e.offset / sizeof(Slot), o->second.slotCnt - 1)].p;
+            }
+            break;
+        case Type::Store: {
+            auto* p = findPtr(e.ptr);
+            if (!p) {
+                unknownPtrs++;
+                break;
+            }
+            if (!e.obj) {
+                *p = nullptr;
+            } else {
+                auto o = objects.find(e.obj);
+                if (o != objects.end())
+                    *p = gc<Slot>(o->second.meta);
+            }
+            stores++;
+            break;
+        }
+        case Type::DeletePtr:
+            roots.erase(e.ptr);
+            subPtrs.erase(e.ptr);
+            break;
+        case Type::Collect:
+            collections++;
+            if (e.collect == AllocTraceEvent::CollectKind::Minor)
+                gc_collector()->minorCollect();
+            else if (e.collect == AllocTraceEvent::CollectKind::Full)
+                gc_collector()->fullCollect();
+            else
+                gc_collector()->collectStep(e.budget);
+            break;
+        }
+    }
+};
+
+int main(int argc, char** argv) {
+    const char* path = nullptr;
+    bool json = false, backgroundSweep = false;
+    unsigned markThreads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json"))
+            json = true;
+        else if (!strcmp(argv[i], "--background-sweep"))
+            backgroundSweep = true;
+        else if (!strcmp(argv[i], "--mark-threads") && i + 1 < argc)
+            markThreads = (unsigned)atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s <trace> [--json] [--mark-threads n] [--background-sweep]\n", argv[0]);
+        return 2;
+    }
+
+    details::AllocTraceReader reader;
+    if (!reader.open(path)) {
+        fprintf(stderr, "unable to read trace '%s'\n", path);
+        return 1;
+    }
+
+    auto* heap = gc_create_heap();
+    auto* listener = new ReplayListener;
+    heap->setListener(listener);
+    heap->setGcCondition(nullptr); // only the recorded collections run
+    heap->setMarkThreads(markThreads);
+    heap->setBackgroundSweep(backgroundSweep);
+    Replay replay;
+    double seconds;
+    {
+        gc_heap_scope scope(heap);
+        AllocTraceEvent e;
+        auto start = Clock::now();
+        while (reader.next(e))
+            replay.apply(e);
+        heap->finishSweep();
+        seconds = chrono::duration<double>(Clock::now() - start).count();
+        replay.clear();
+    }
+    auto minor = listener->minor, full = listener->full;
+    auto peakLive = listener->peakLive;
+    gc_destroy_heap(heap);
+
+    auto us = [](chrono::nanoseconds d) { return d.count() / 1e3; };
+    if (json) {
+        printf(
+            "{\"trace\":\"%s\",\"seconds\":%.6f,\"events\":%zu,\"classes\":%zu,\"allocations\":%zu,"
+            "\"stores\":%zu,\"unknown_ptr_stores\":%zu,\"collections\":%zu,"
+            "\"minor_count\":%zu,\"minor_p50_us\":%.3f,\"minor_p99_us\":%.3f,\"minor_max_us\":%.3f,"
+            "\"full_count\":%zu,\"full_p50_us\":%.3f,\"full_p99_us\":%.3f,\"full_max_us\":%.3f,"
+            "\"peak_live_bytes\":%zu}\n",
+            path,
+            seconds,
+            replay.events,
+            replay.classes,
+            replay.allocations,
+            replay.stores,
+            replay.unknownPtrs,
+            replay.collections,
+            minor.count(),
+            us(minor.percentile(0.5)),
+            us(minor.percentile(0.99)),
+            us(minor.max()),
+            full.count(),
+            us(full.percentile(0.5)),
+            us(full.percentile(0.99)),
+            us(full.max()),
+            peakLive);
+    } else {
+        printf("trace              %s\n", path);
+        printf("time               %.1f ms\n", seconds * 1e3);
+        printf("events             %zu\n", replay.events);
+        printf("classes            %zu\n", replay.classes);
+        printf("allocations        %zu\n", replay.allocations);
+        printf("stores             %zu (%zu to unknown pointers)\n", replay.stores, replay.unknownPtrs);
+        printf("collections        %zu\n", replay.collections);
+        printf(
+            "minor collections  %zu (p50 %.1f us, p99 %.1f us, max %.1f us)\n",
+            minor.count(),
+            us(minor.percentile(0.5)),
+            us(minor.percentile(0.99)),
+            us(minor.max()));
+        printf(
+            "full collections   %zu (p50 %.1f us, p99 %.1f us, max %.1f us)\n",
+            full.count(),
+            us(full.percentile(0.5)),
+            us(full.percentile(0.99)),
+            us(full.max()));
+        printf("peak live bytes    %zu\n", peakLive);
+    }
+    return 0;
+}
@@ -1,7 +1,16 @@
 #include "tgc2.h"
 
 #include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
 #include <stdexcept>
+#include <thread>
 
 #ifdef _WIN32
 #include <crtdbg.h>
@@ -10,360 +19,2628 @@
 namespace tgc2 {
     namespace details {
 
-        int ClassMeta::isCreatingObj = 0;
         ClassMeta::Alloc ClassMeta::alloc = nullptr;
         ClassMeta::Dealloc ClassMeta::dealloc = nullptr;
         Collector* Collector::inst = nullptr;
-        vector<char*> IPtrEnumerator::buf;
+        Collector* Collector::heaps[Collector::MaxHeaps] = {};
+        atomic<int> PtrBase::incrementalMarking{0};
+        atomic<int> PtrBase::recordingHeaps{0};
+
+        static mutex heapsMtx;
+        static uint64_t lastHeapId = 0;
+        static thread_local Collector* currentHeap = nullptr;
+
+        // Classes are shared by all heaps.
+        static mutex registerMtx;
+        static mutex classNamesMtx;
+
+        // Indexed by `ClassMeta::id`, filled while the classes are initialized.
+        static vector<string_view>& classNames() {
+            static vector<string_view> names;
+            return names;
+        }
 
         //////////////////////////////////////////////////////////////////////////
 
+        static inline void prefetch(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(p);
+#else
+            (void)p;
+#endif
+        }
+
         template <typename C> void vector_remove(C& c, typename C::value_type& v) {
             c.erase(remove(c.begin(), c.end(), v), c.end());
         }
 
-        //////////////////////////////////////////////////////////////////////////
-
-        void ObjMeta::destroy() {
-            if (!arrayLength)
-                return;
-            klass->memHandler(klass, ClassMeta::MemRequest::Dctor, objPtr(), arrayLength);
-            arrayLength = 0;
+        // Calls `f` for every sub pointer of the object, returns the number of sub pointers.
+        template <typename F> size_t forEachSubPtr(ObjMeta* meta, F&& f) {
+            using Fn = remove_reference_t<F>;
+            PtrVisitor v(
+                [](void* ctx, const PtrBase* const* ptrs, size_t cnt) {
+                    auto& fn = *(Fn*)ctx;
+                    for (size_t i = 0; i < cnt; i++)
+                        fn(ptrs[i]);
+                },
+                &f);
+            meta->klass->tracePtrs(meta, v);
+            v.flush();
+            return v.visitedCount;
+        }
+
+        // Whether `p` is listed by `TGC_FIELDS` in the element of the declared object holding it.
+        static bool isDeclaredField(ObjMeta* meta, const PtrBase* p) {
+            struct Search {
+                const PtrBase* p;
+                bool found;
+            } search{p, false};
+            PtrVisitor v(
+                [](void* ctx, const PtrBase* const* ptrs, size_t cnt) {
+                    auto& s = *(Search*)ctx;
+                    for (size_t i = 0; i < cnt; i++)
+                        s.found |= ptrs[i] == s.p;
+                },
+                &search);
+            auto size = meta->klass->size;
+            auto* elem = meta->objPtr() + ((char*)p - meta->objPtr()) / size * size;
+            meta->klass->tracePtrs(elem, 1, v);
+            v.flush();
+            return search.found;
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        // Size classes step by 16 bytes up to 256 and then by a quarter of each power of two.
+        struct SizeClassTable {
+            size_t sizes[PageAllocator::SizeClassCount] = {};
+            unsigned char classOfGranule[PageAllocator::MaxSmallSize / PageAllocator::Granularity + 1] = {};
+
+            constexpr SizeClassTable() {
+                size_t cls = 0, sz = PageAllocator::Granularity;
+                while (sz <= PageAllocator::MaxSmallSize) {
+                    sizes[cls++] = sz;
+                    size_t step = 16;
+                    while (sz >= 256 && step * 8 <= sz)
+                        step *= 2;
+                    sz += step;
+                }
+                cls = 0;
+                for (size_t g = 0; g < sizeof(classOfGranule); g++) {
+                    while (sizes[cls] < g * PageAllocator::Granularity)
+                        cls++;
+                    classOfGranule[g] = (unsigned char)cls;
+                }
+            }
+        };
+
+        static constexpr SizeClassTable sizeClassTable;
+
+        static_assert(sizeClassTable.sizes[PageAllocator::SizeClassCount - 1] == PageAllocator::MaxSmallSize);
+
+        // Process-wide bitmap of the `PageSize` units held by any page allocator, a radix tree
+        // over the user address space. Leaves are created on demand and never freed, so lookups
+        // need no lock. Zero-initialized as a static, usable before any constructor runs.
+        class PageMap {
+        public:
+            static constexpr int AddressBits = sizeof(void*) == 8 ? 48 : 32;
+            static constexpr int UnitBits = 16;
+            static constexpr int LeafBits = 16;
+            static_assert(PageAllocator::PageSize == size_t(1) << UnitBits);
+
+            void set(const void* p, size_t size, bool used) {
+                auto first = (uintptr_t)p >> UnitBits, last = ((uintptr_t)p + size - 1) >> UnitBits;
+                for (auto unit = first; unit <= last; unit++) {
+                    auto& word = leafOf(unit)->words[(unit & LeafMask) / 64];
+                    auto bit = uint64_t(1) << (unit % 64);
+                    used ? word.fetch_or(bit, memory_order_relaxed) : word.fetch_and(~bit, memory_order_relaxed);
+                }
+            }
+
+            bool contains(const void* p) const {
+                auto a = (uintptr_t)p;
+                if constexpr (AddressBits < sizeof(uintptr_t) * 8) {
+                    if (a >> AddressBits)
+                        return false;
+                }
+                auto unit = a >> UnitBits;
+                auto* leaf = root[unit >> LeafBits].load(memory_order_acquire);
+                return leaf && (leaf->words[(unit & LeafMask) / 64].load(memory_order_relaxed) >> (unit % 64) & 1);
+            }
+
+        private:
+            static constexpr uintptr_t LeafMask = (uintptr_t(1) << LeafBits) - 1;
+
+            struct Leaf {
+                atomic<uint64_t> words[(size_t(1) << LeafBits) / 64];
+            };
+
+            Leaf* leafOf(uintptr_t unit) {
+                auto& slot = root[unit >> LeafBits];
+                auto* leaf = slot.load(memory_order_acquire);
+                if (!leaf) {
+                    auto* created = new Leaf();
+                    if (slot.compare_exchange_strong(leaf, created, memory_order_acq_rel))
+                        leaf = created;
+                    else
+                        delete created;
+                }
+                return leaf;
+            }
+
+            atomic<Leaf*> root[size_t(1) << (AddressBits - UnitBits - LeafBits)];
+        };
+
+        static PageMap pageMap;
+
+        bool PageAllocator::contains(const void* p) { return pageMap.contains(p); }
+
+        void* PageAllocator::reservePage(size_t size) {
+            if (limit && stats.reservedBytes + size > limit)
+                throw std::bad_alloc();
+            auto* p = operator new(size, align_val_t(PageSize));
+            pageMap.set(p, size, true);
+            return p;
+        }
+
+        char* PageAllocator::Page::slots() { return (char*)this + HeaderSize; }
+
+        PageAllocator::PageAllocator() {}
+
+        PageAllocator::~PageAllocator() {
+            for (auto& pageList : partialPages) {
+                while (pageList.size()) {
+                    auto* page = pageList.back();
+                    pageList.pop_back();
+                    freePage(page);
+                }
+            }
+        }
+
+        void* PageAllocator::allocate(size_t size) {
+            Guard g(*this);
+            if (size > MaxSmallSize)
+                return allocateLarge(size);
+
+            auto sizeClass = sizeClassTable.classOfGranule[(size + Granularity - 1) / Granularity];
+            auto& pageList = partialPages[sizeClass];
+            auto* page = pageList.back();
+            if (!page) {
+                page = newPage(sizeClass);
+                pageList.push_back(page);
+            }
+
+            void* p;
+            if (page->freeList) {
+                p = page->freeList;
+                page->freeList = *(void**)p;
+            } else {
+                p = page->slots() + page->bumpIdx++ * page->slotSize;
+            }
+
+            if (++page->usedCount == page->capacity)
+                pageList.remove(page);
+
+            classUsedSlots[sizeClass]++;
+            stats.usedSlots++;
+            stats.usedBytes += page->slotSize;
+            return p;
+        }
+
+        void* PageAllocator::allocateLarge(size_t size) {
+            auto reserved = HeaderSize + size;
+            auto* page = new (reservePage(reserved)) Page();
+            page->owner = this;
+            page->kind = Page::Kind::Large;
+            page->slotSize = size;
+            page->usedCount = 1;
+
+            stats.largePageCount++;
+            stats.usedBytes += size;
+            stats.reservedBytes += reserved;
+            return page->slots();
+        }
+
+        void PageAllocator::deallocate(void* p) {
+            auto* page = pageOf(p);
+            Guard g(*page->owner);
+            page->owner->release(page, p);
+        }
+
+        void PageAllocator::release(Page* page, void* p) {
+            if (page->kind == Page::Kind::Nursery) {
+                // The last pinned survivor is gone.
+                if (--page->usedCount == 0)
+                    freePage(page);
+                return;
+            }
+
+            stats.usedBytes -= page->slotSize;
+            if (page->kind == Page::Kind::Large) {
+                freePage(page);
+                return;
+            }
+
+            auto& pageList = partialPages[page->sizeClass];
+            if (page->usedCount == page->capacity)
+                pageList.push_back(page);
+
+            *(void**)p = page->freeList;
+            page->freeList = p;
+            page->usedCount--;
+            classUsedSlots[page->sizeClass]--;
+            stats.usedSlots--;
+
+            if (page->usedCount == 0) {
+                if (pageList.size() > 1) {
+                    // Keep only one empty page per size class to avoid thrashing.
+                    pageList.remove(page);
+                    freePage(page);
+                } else {
+                    // Reuse the page from its start for better locality.
+                    page->freeList = nullptr;
+                    page->bumpIdx = 0;
+                }
+            }
+        }
+
+        PageAllocator::Page* PageAllocator::newPage(unsigned char sizeClass) {
+            auto* page = new (reservePage(PageSize)) Page();
+            page->owner = this;
+            page->sizeClass = sizeClass;
+            page->slotSize = sizeClassTable.sizes[sizeClass];
+            page->capacity = (unsigned int)((PageSize - HeaderSize) / page->slotSize);
+
+            classPageCount[sizeClass]++;
+            stats.smallPageCount++;
+            stats.totalSlots += page->capacity;
+            stats.reservedBytes += PageSize;
+            return page;
+        }
+
+        PageAllocator::Page* PageAllocator::newNurseryPage() {
+            Guard g(*this);
+            auto* page = new (reservePage(PageSize)) Page();
+            page->owner = this;
+            page->kind = Page::Kind::Nursery;
+            page->slotSize = PageSize - HeaderSize;
+
+            stats.nurseryPageCount++;
+            stats.reservedBytes += PageSize;
+            return page;
+        }
+
+        void PageAllocator::freePage(Page* page) {
+            auto reserved = PageSize;
+            if (page->kind == Page::Kind::Large) {
+                stats.largePageCount--;
+                reserved = HeaderSize + page->slotSize;
+            } else if (page->kind == Page::Kind::Nursery) {
+                stats.nurseryPageCount--;
+            } else {
+                classPageCount[page->sizeClass]--;
+                stats.smallPageCount--;
+                stats.totalSlots -= page->capacity;
+            }
+            stats.reservedBytes -= reserved;
+            pageMap.set(page, reserved, false);
+            page->~Page();
+            operator delete(page, align_val_t(PageSize));
+        }
+
+        void PageAllocator::releaseEmptyPages() {
+            Guard g(*this);
+            for (auto& pageList : partialPages) {
+                for (auto it = pageList.begin(); it != pageList.end();) {
+                    auto* page = *it;
+                    if (page->usedCount) {
+                        ++it;
+                        continue;
+                    }
+                    it = pageList.erase(it);
+                    freePage(page);
+                }
+            }
+        }
+
+        PageAllocator::ClassStats PageAllocator::getClassStats(size_t sizeClass) const {
+            ClassStats s;
+            s.slotSize = sizeClassTable.sizes[sizeClass];
+            s.pageCount = classPageCount[sizeClass];
+            s.usedSlots = classUsedSlots[sizeClass];
+            return s;
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        Nursery::~Nursery() {
+            for (auto* page : usedPages)
+                pages.freePage(page);
+            for (auto* page : freePages)
+                pages.freePage(page);
+            // The survivors are gone, only the pins of the nursery are left.
+            for (size_t i = 0; i < holes.size(); i++) {
+                auto* page = PageAllocator::pageOf(holes[i].begin);
+                if (i + 1 < holes.size() && PageAllocator::pageOf(holes[i + 1].begin) == page)
+                    continue;
+                if (--page->usedCount == 0)
+                    pages.freePage(page);
+            }
+        }
+
+        void* Nursery::refill(AllocationBuffer& buffer, size_t size) {
+#ifdef TGC_MULTI_THREADED
+            lock_guard<mutex> lk(mtx);
+#endif
+            // Holes too small for the object are skipped until the next collection.
+            while (nextHole < holes.size() && (size_t)(holes[nextHole].end - holes[nextHole].begin) < size)
+                nextHole++;
+            if (nextHole < holes.size()) {
+                buffer.cursor = holes[nextHole].begin;
+                buffer.limit = holes[nextHole].end;
+                nextHole++;
+            } else {
+                PageAllocator::Page* page;
+                if (freePages.size()) {
+                    page = freePages.back();
+                    freePages.pop_back();
+                } else {
+                    page = pages.newNurseryPage();
+                }
+                usedPages.push_back(page);
+                buffer.cursor = page->slots();
+                buffer.limit = page->slots() + page->slotSize;
+            }
+            used.fetch_add(buffer.limit - buffer.cursor, std::memory_order_relaxed);
+
+            // Objects under construction are traced if a collection runs meanwhile (e.g. started
+            // by an allocation), their members not constructed yet have to read as null pointers.
+            memset(buffer.cursor, 0, buffer.limit - buffer.cursor);
+            return allocate(buffer, size);
+        }
+
+        Nursery::Detached Nursery::detachPages() {
+            Detached detached;
+            detached.pages.swap(usedPages);
+            detached.pinnedFrom = detached.pages.size();
+            detached.freeLines.resize(detached.pages.size());
+            for (auto& lines : detached.freeLines)
+                lines.set();
+            for (auto& hole : holes) {
+                auto* page = PageAllocator::pageOf(hole.begin);
+                if (detached.pages.size() == detached.pinnedFrom || detached.pages.back() != page) {
+                    detached.pages.push_back(page);
+                    detached.freeLines.emplace_back();
+                }
+                size_t begin = hole.begin - (char*)page, end = hole.end - (char*)page;
+                for (auto i = begin / LineSize; i * LineSize < end; i++)
+                    detached.freeLines.back().set(i);
+            }
+            for (size_t i = 0; i < detached.pages.size(); i++)
+                detached.pages[i]->bumpIdx = (unsigned int)i;
+            holes.clear();
+            nextHole = 0;
+            used.store(0, std::memory_order_relaxed);
+            return detached;
+        }
+
+        void Nursery::pin(Detached& detached, const void* block, size_t size) {
+            auto* page = PageAllocator::pageOf(block);
+            assert(page->bumpIdx < detached.pages.size() && detached.pages[page->bumpIdx] == page);
+            size_t offset = (const char*)block - (const char*)page;
+            auto& lines = detached.freeLines[page->bumpIdx];
+            for (auto i = offset / LineSize; i <= (offset + size - 1) / LineSize; i++)
+                lines.reset(i);
+            page->usedCount++;
+        }
+
+        void Nursery::recyclePages(Detached& detached) {
+            for (size_t i = 0; i < detached.pages.size(); i++) {
+                auto* page = detached.pages[i];
+                // The pin of the nursery is taken again if the page still has holes.
+                if (i >= detached.pinnedFrom)
+                    page->usedCount--;
+                if (!page->usedCount) {
+                    recyclePage(page);
+                    continue;
+                }
+                auto& lines = detached.freeLines[i];
+                auto first = holes.size();
+                for (size_t line = 0; line < LinesPerPage;) {
+                    if (!lines.test(line)) {
+                        line++;
+                        continue;
+                    }
+                    auto begin = line;
+                    while (line < LinesPerPage && lines.test(line))
+                        line++;
+                    // The header is inside the first line.
+                    auto* start = std::max((char*)page + begin * LineSize, page->slots());
+                    holes.push_back({start, (char*)page + line * LineSize});
+                }
+                if (holes.size() > first)
+                    page->usedCount++;
+            }
+        }
+
+        void Nursery::recyclePage(PageAllocator::Page* page) {
+            if (freePages.size() < FreePagesToKeep)
+                freePages.push_back(page);
+            else
+                pages.freePage(page);
+        }
+
+        void Nursery::releaseFreePages() {
+#ifdef TGC_MULTI_THREADED
+            lock_guard<mutex> lk(mtx);
+#endif
+            PageAllocator::Guard g(pages);
+            for (auto* page : freePages)
+                pages.freePage(page);
+            freePages.clear();
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        void ObjMeta::destroy() {
+            if (!arrayLength)
+                return;
+            Collector::heaps[heap]->objDestroyed(this);
+            finalize();
+        }
+
+        void ObjMeta::finalize() {
+            klass->memHandler(klass, ClassMeta::MemRequest::Dctor, objPtr(), arrayLength, nullptr);
+            arrayLength = 0;
+        }
+
+        size_t ObjMeta::blockSize() const { return sizeof(ObjMeta) + (size_t)klass->size * arrayLength; }
+
+        void ObjMeta::operator delete(void* p) {
+            auto* m = (ObjMeta*)p;
+            if (m->klass->isContainer) {
+                auto* c = Collector::heaps[m->heap];
+                (m->isOld ? c->oldContainers : c->youngContainers).erase(m);
+            }
+            m->klass->callDealloc(m);
+        }
+
+        bool ObjMeta::containsPtr(char* p) {
+            auto* o = objPtr();
+            return o <= p && p < o + klass->size * arrayLength;
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        void ObjPtrEnumerator::trace(ClassMeta* klass, char* obj, size_t len, PtrVisitor& v) {
+            // The first instance may be traced while constructed (by a collection started by its own
+            // allocations or by another thread), only the offsets known so far are visited then, the
+            // members not constructed yet are zeroed.
+            if (auto* subPtrs = klass->subPtrOffsets) {
+                for (size_t i = 0; i < len; i++, obj += klass->size) {
+                    for (auto offset : *subPtrs)
+                        v.visit((PtrBase*)(obj + offset));
+                }
+            }
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        // A trace is the magic followed by tagged events. Numbers are LEB128 varints, addresses
+        // are zigzag encoded differences from the previous object (or pointer) address, as pointers
+        // mostly live on the stack and objects in the nursery.
+        static const char TraceMagic[8] = {'T', 'G', 'C', 'T', 'R', 'A', 'C', 'E'};
+        static constexpr unsigned TraceVersion = 1;
+
+        // Buffers the events of the heap, recorded by all of its threads.
+        class AllocTraceWriter {
+        public:
+            using Type = AllocTraceEvent::Type;
+
+            explicit AllocTraceWriter(FILE* f) : file(f) {
+                ok = fwrite(TraceMagic, 1, sizeof(TraceMagic), file) == sizeof(TraceMagic);
+                varint(TraceVersion);
+            }
+            ~AllocTraceWriter() { close(); }
+
+            // Returns false if the trace could not be written completely.
+            bool close() {
+                if (!file)
+                    return ok;
+                flush();
+                ok = fclose(file) == 0 && ok;
+                file = nullptr;
+                return ok;
+            }
+
+            void alloc(ObjMeta* meta) {
+                lock_guard<mutex> lk(mtx);
+                auto* klass = meta->klass;
+                if (classes.size() <= klass->id)
+                    classes.resize(klass->id + 1);
+                if (!classes[klass->id]) {
+                    classes[klass->id] = true;
+                    auto name = klass->name();
+                    tag(Type::Class);
+                    varint(klass->id);
+                    varint(name.size());
+                    buf.insert(buf.end(), name.begin(), name.end());
+                }
+                tag(Type::Alloc);
+                objAddress(meta);
+                varint(klass->id);
+                varint(klass->size);
+                varint(meta->arrayLength);
+            }
+            void constructed(ObjMeta* meta) {
+                lock_guard<mutex> lk(mtx);
+                tag(Type::Constructed);
+                objAddress(meta);
+            }
+            void newPtr(const PtrBase* p, ObjMeta* owner) {
+                lock_guard<mutex> lk(mtx);
+                tag(Type::NewPtr);
+                ptrAddress(p);
+                objAddress(owner);
+                if (owner)
+                    varint((char*)p - owner->objPtr());
+            }
+            void store(const PtrBase* p, ObjMeta* target) {
+                lock_guard<mutex> lk(mtx);
+                tag(Type::Store);
+                ptrAddress(p);
+                objAddress(target);
+            }
+            void deletePtr(const PtrBase* p) {
+                lock_guard<mutex> lk(mtx);
+                tag(Type::DeletePtr);
+                ptrAddress(p);
+            }
+            void collect(AllocTraceEvent::CollectKind kind, std::chrono::microseconds budget) {
+                lock_guard<mutex> lk(mtx);
+                tag(Type::Collect);
+                varint((uint64_t)kind);
+                if (kind == AllocTraceEvent::CollectKind::Step)
+                    varint(budget.count());
+            }
+
+        private:
+            static constexpr size_t BufferSize = 64 * 1024;
+
+            void tag(Type t) {
+                if (buf.size() >= BufferSize)
+                    flush();
+                buf.push_back((unsigned char)t);
+            }
+            void varint(uint64_t v) {
+                for (; v >= 0x80; v >>= 7)
+                    buf.push_back((unsigned char)(v | 0x80));
+                buf.push_back((unsigned char)v);
+            }
+            void address(const void* p, uint64_t& last) {
+                auto a = (uint64_t)(uintptr_t)p;
+                auto d = (int64_t)(a - last);
+                last = a;
+                varint(((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+            }
+            void objAddress(const ObjMeta* meta) { address(meta, lastObj); }
+            void ptrAddress(const PtrBase* p) { address(p, lastPtr); }
+            void flush() {
+                // Nothing is written after an error (e.g. a full disk), the trace is reported truncated.
+                if (ok)
+                    ok = fwrite(buf.data(), 1, buf.size(), file) == buf.size();
+                buf.clear();
+            }
+
+            mutex mtx;
+            FILE* file;
+            bool ok = true;
+            vector<unsigned char> buf;
+            uint64_t lastObj = 0, lastPtr = 0;
+            vector<bool> classes; // already written, by `ClassMeta::id`
+        };
+
+        AllocTraceReader::~AllocTraceReader() {
+            if (file)
+                fclose(file);
+        }
+
+        bool AllocTraceReader::open(const char* path) {
+            if (file)
+                fclose(file);
+            pos = end = 0;
+            lastObj = lastPtr = 0;
+            file = fopen(path, "rb");
+            if (!file)
+                return false;
+            char magic[sizeof(TraceMagic)];
+            for (auto& c : magic)
+                c = (char)byte();
+            return memcmp(magic, TraceMagic, sizeof(magic)) == 0 && varint() == TraceVersion;
+        }
+
+        int AllocTraceReader::byte() {
+            if (pos == end) {
+                pos = 0;
+                end = file ? fread(buf, 1, sizeof(buf), file) : 0;
+                if (!end)
+                    return -1;
+            }
+            return buf[pos++];
+        }
+
+        uint64_t AllocTraceReader::varint() {
+            uint64_t v = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                auto b = byte();
+                if (b < 0)
+                    break;
+                v |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    break;
+            }
+            return v;
+        }
+
+        uint64_t AllocTraceReader::address(uint64_t& last) {
+            auto z = varint();
+            auto d = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+            last += (uint64_t)d;
+            return last;
+        }
+
+        bool AllocTraceReader::next(AllocTraceEvent& e) {
+            using Type = AllocTraceEvent::Type;
+            auto t = byte();
+            if (t < 0)
+                return false;
+            e = AllocTraceEvent();
+            e.type = (Type)t;
+            switch (e.type) {
+            case Type::Class: {
+                e.klass = (unsigned short)varint();
+                auto len = varint();
+                for (uint64_t i = 0; i < len; i++)
+                    e.name += (char)byte();
+                break;
+            }
+            case Type::Alloc:
+                e.obj = address(lastObj);
+                e.klass = (unsigned short)varint();
+                e.size = varint();
+                e.length = varint();
+                break;
+            case Type::Constructed:
+                e.obj = address(lastObj);
+                break;
+            case Type::NewPtr:
+                e.ptr = address(lastPtr);
+                e.obj = address(lastObj);
+                if (e.obj)
+                    e.offset = varint();
+                break;
+            case Type::Store:
+                e.ptr = address(lastPtr);
+                e.obj = address(lastObj);
+                break;
+            case Type::DeletePtr:
+                e.ptr = address(lastPtr);
+                break;
+            case Type::Collect:
+                e.collect = (AllocTraceEvent::CollectKind)varint();
+                if (e.collect == AllocTraceEvent::CollectKind::Step)
+                    e.budget = std::chrono::microseconds(varint());
+                break;
+            default:
+                return false; // corrupted
+            }
+            return true;
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        PtrBase::PtrBase() : slot(SlotTable::NoSlot), isOld(false), isRoot(true) {
+            auto* c = Collector::current();
+            heap = c->index;
+            auto* owner = c->tryRegisterToClass(this);
+            if (isRoot)
+                c->addRoot(this);
+            if (recordingHeaps.load(memory_order_relaxed) && c->recorder)
+                c->recorder->newPtr(this, owner);
+        }
+
+        PtrBase::PtrBase(void* obj) : slot(SlotTable::NoSlot), isOld(false), isRoot(true) {
+            auto* c = Collector::current();
+            heap = c->index;
+            meta = c->globalFindOwnerMeta(obj);
+            if (!meta) {
+                throw std::runtime_error("unable to construct gc pointer, this usually happens when you "
+                                         "are trying to construct a gc pointer from a raw pointer, this "
+                                         "is not supported");
+            }
+            auto* owner = c->tryRegisterToClass(this);
+            if (isRoot)
+                c->addRoot(this);
+            if (recordingHeaps.load(memory_order_relaxed) && c->recorder)
+                c->recorder->newPtr(this, owner);
+            writeBarrier();
+        }
+
+        PtrBase::~PtrBase() {
+            if (slot != SlotTable::NoSlot)
+                Collector::heaps[heap]->removePtr(this);
+            // Sub pointers die with their object, container elements live outside of the gc heap.
+            if (recordingHeaps.load(memory_order_relaxed)) {
+                auto* r = Collector::heaps[heap]->recorder;
+                if (r && (isRoot || ClassMeta::alloc || !PageAllocator::contains(this)))
+                    r->deletePtr(this);
+            }
+        }
+
+        void PtrBase::writeBarrierSlow() { Collector::heaps[heap]->addRemembered(this); }
+
+        void PtrBase::recordStoreSlow() {
+            if (auto* r = Collector::heaps[heap]->recorder)
+                r->store(this, meta);
+        }
+
+        void PtrBase::shadeSlow() {
+            // Another heap may be the one marking.
+            auto* c = Collector::heaps[heap];
+            if (c->phase == Collector::Phase::Mark)
+                c->shadeFromMutator(meta);
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        ObjMeta* ClassMeta::newMeta(size_t cnt) {
+            auto* c = Collector::current();
+            auto& m = c->mutator();
+            c->safepoint();
+#ifdef TGC_MULTI_THREADED
+            m.lastAllocated = nullptr;
+#endif
+            c->collectIfNeeded();
+
+            auto blockSize = size * cnt + sizeof(ObjMeta);
+            // Collects harder after every failed attempt, see `Collector::setHeapLimit`.
+            for (int attempt = 0;; attempt++) {
+                ObjMeta* meta = nullptr;
+                try {
+                    m.isCreatingObj++;
+                    // Containers are kept out of the nursery since their sub pointers are only
+                    // classified by collections (see `Collector::adoptElems`).
+                    if (!alloc && !isContainer && blockSize <= Nursery::MaxObjectSize) {
+                        auto* p = (char*)c->nursery.allocate(m.tlab, blockSize);
+                        meta = new (p) ObjMeta(this, p + sizeof(ObjMeta), cnt, c->index);
+                        c->addNurseryMeta(meta);
+                        return meta;
+                    }
+#ifdef TGC_MULTI_THREADED
+                    lock_guard<mutex> lk(c->heapMtx);
+#endif
+                    auto* p = callAlloc(c->pages, blockSize);
+                    if (mayHavePtrs())
+                        memset(p, 0, blockSize); // see `Nursery::refill`
+                    meta = new (p) ObjMeta(this, p + sizeof(ObjMeta), cnt, c->index);
+                    // Allow using gc_from(this) in the constructor of the creating object.
+                    c->addMeta(meta);
+                    return meta;
+                } catch (std::bad_alloc&) {
+                    m.isCreatingObj--;
+                    // The registration is undone already, nursery blocks stay in their page.
+                    if (meta && !meta->inNursery)
+                        callDealloc(meta);
+                    if (!c->reclaim(attempt, blockSize))
+                        throw;
+                }
+            }
+        }
+
+        void ClassMeta::endNewMeta(ObjMeta* meta, bool failed) {
+            auto* c = Collector::heaps[meta->heap];
+            auto& m = c->mutator();
+            if (c->recorder)
+                c->recorder->constructed(meta);
+            m.isCreatingObj--;
+            if (declared)
+                m.creatingDeclared.pop_back();
+            else
+                vector_remove(m.creatingObjs, meta);
+            if (failed) {
+                if (meta->inNursery) {
+                    // Elements are already destroyed, the block is reclaimed with its page.
+                    c->objDestroyed(meta);
+                    meta->arrayLength = 0;
+                } else {
+#ifdef TGC_MULTI_THREADED
+                    lock_guard<mutex> lk(c->heapMtx);
+                    vector_remove(m.grey, meta);
+#endif
+                    c->objDestroyed(meta);
+                    (meta->isOld ? c->oldGen : c->newGen).remove(meta);
+                    if (c->phase == Collector::Phase::Mark)
+                        vector_remove(c->grey, meta);
+                    callDealloc(meta);
+                }
+            } else {
+                if (!registered.load(memory_order_relaxed)) {
+                    if (isContainer)
+                        memHandler(this, MemRequest::RegisterElems, nullptr, 0, nullptr);
+                    registered = true;
+                }
+#ifdef TGC_MULTI_THREADED
+                m.lastAllocated = meta;
+#endif
+            }
+        }
+
+        char* ClassMeta::callAlloc(PageAllocator& pages, size_t sz) {
+            return alloc ? (char*)alloc(sz) : (char*)pages.allocate(sz);
+        }
+
+        void ClassMeta::callDealloc(void* p) { dealloc ? dealloc(p) : PageAllocator::deallocate(p); }
+
+        unsigned short ClassMeta::registerClass(string_view name) {
+            lock_guard<mutex> lk(classNamesMtx);
+            auto& names = classNames();
+            assert(names.size() <= USHRT_MAX && "too many classes");
+            names.push_back(name);
+            return (unsigned short)(names.size() - 1);
+        }
+
+        string_view ClassMeta::name() const {
+            lock_guard<mutex> lk(classNamesMtx);
+            return classNames()[id];
+        }
+
+        void ClassMeta::registerSubPtr(ObjMeta* owner, PtrBase* p) {
+            // First instances may be constructed by several threads (or heaps) at once.
+            lock_guard<mutex> lk(registerMtx);
+            // The elements of an array share the layout of the first one.
+            if ((size_t)((char*)p - owner->objPtr()) >= size)
+                return;
+            auto offset = (OffsetType)((char*)p - owner->objPtr());
+            if (!subPtrOffsets) {
+                subPtrOffsets = new vector<OffsetType>();
+                subPtrOffsets->push_back(offset);
+            } else if (offset > subPtrOffsets->back()) { // constructor recursived
+                subPtrOffsets->push_back(offset);
+            }
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        // Persistent helper threads running one job at a time together with the caller.
+        class WorkerPool {
+        public:
+            explicit WorkerPool(unsigned threadCnt) {
+                for (unsigned i = 1; i < threadCnt; i++)
+                    threads.emplace_back([this, i] { loop(i); });
+            }
+
+            ~WorkerPool() {
+                {
+                    lock_guard<mutex> lk(mtx);
+                    stop = true;
+                }
+                wake.notify_all();
+                for (auto& t : threads)
+                    t.join();
+            }
+
+            unsigned size() const { return (unsigned)threads.size() + 1; }
+
+            // Calls `fn(idx)` for every idx in [0, size()), idx 0 on the calling thread.
+            void run(const function<void(unsigned)>& fn) {
+                {
+                    lock_guard<mutex> lk(mtx);
+                    job = &fn;
+                    pending = (unsigned)threads.size();
+                    generation++;
+                }
+                wake.notify_all();
+                fn(0);
+                unique_lock<mutex> lk(mtx);
+                done.wait(lk, [&] { return pending == 0; });
+                job = nullptr;
+            }
+
+        private:
+            void loop(unsigned idx) {
+                size_t seen = 0;
+                for (;;) {
+                    const function<void(unsigned)>* fn;
+                    {
+                        unique_lock<mutex> lk(mtx);
+                        wake.wait(lk, [&] { return stop || generation != seen; });
+                        if (stop)
+                            return;
+                        seen = generation;
+                        fn = job;
+                    }
+                    (*fn)(idx);
+                    {
+                        lock_guard<mutex> lk(mtx);
+                        pending--;
+                    }
+                    done.notify_one();
+                }
+            }
+
+            vector<thread> threads;
+            mutex mtx;
+            condition_variable wake, done;
+            const function<void(unsigned)>* job = nullptr;
+            size_t generation = 0;
+            unsigned pending = 0;
+            bool stop = false;
+        };
+
+        // Persistent helper thread running one job at a time while the caller goes on.
+        class BackgroundWorker {
+        public:
+            BackgroundWorker() : worker([this] { loop(); }) {}
+
+            ~BackgroundWorker() {
+                {
+                    lock_guard<mutex> lk(mtx);
+                    stop = true;
+                }
+                wake.notify_one();
+                worker.join();
+            }
+
+            // The previous job has to be waited for first.
+            void start(function<void()> fn) {
+                {
+                    lock_guard<mutex> lk(mtx);
+                    job = std::move(fn);
+                }
+                wake.notify_one();
+            }
+
+            void wait() {
+                unique_lock<mutex> lk(mtx);
+                done.wait(lk, [&] { return !job; });
+            }
+
+        private:
+            void loop() {
+                unique_lock<mutex> lk(mtx);
+                for (;;) {
+                    wake.wait(lk, [&] { return stop || job; });
+                    if (!job)
+                        return;
+                    lk.unlock();
+                    job();
+                    lk.lock();
+                    job = nullptr;
+                    done.notify_all();
+                }
+            }
+
+            mutex mtx;
+            condition_variable wake, done;
+            function<void()> job;
+            bool stop = false;
+            thread worker; // last, started once the other members are constructed
+        };
+
+        // Chase-Lev work-stealing deque of fixed capacity: the owner pushes and pops at
+        // the bottom, other workers steal from the top.
+        class MarkDeque {
+        public:
+            static constexpr int64_t Capacity = 4096;
+
+            bool push(ObjMeta* m) {
+                auto b = bottom.load(memory_order_relaxed);
+                auto t = top.load(memory_order_acquire);
+                if (b - t >= Capacity)
+                    return false;
+                buf[b & (Capacity - 1)].store(m, memory_order_relaxed);
+                atomic_thread_fence(memory_order_release);
+                bottom.store(b + 1, memory_order_relaxed);
+                return true;
+            }
+
+            ObjMeta* pop() {
+                auto b = bottom.load(memory_order_relaxed) - 1;
+                bottom.store(b, memory_order_relaxed);
+                atomic_thread_fence(memory_order_seq_cst);
+                auto t = top.load(memory_order_relaxed);
+                ObjMeta* m = nullptr;
+                if (t <= b) {
+                    m = buf[b & (Capacity - 1)].load(memory_order_relaxed);
+                    if (t == b) {
+                        // Last element, race against thieves.
+                        if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+                            m = nullptr;
+                        bottom.store(b + 1, memory_order_relaxed);
+                    }
+                } else {
+                    bottom.store(b + 1, memory_order_relaxed);
+                }
+                return m;
+            }
+
+            ObjMeta* steal() {
+                auto t = top.load(memory_order_acquire);
+                atomic_thread_fence(memory_order_seq_cst);
+                auto b = bottom.load(memory_order_acquire);
+                if (t >= b)
+                    return nullptr;
+                auto* m = buf[t & (Capacity - 1)].load(memory_order_relaxed);
+                if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+                    return nullptr;
+                return m;
+            }
+
+            bool empty() const {
+                return bottom.load(memory_order_relaxed) <= top.load(memory_order_relaxed);
+            }
+
+        private:
+            alignas(64) atomic<int64_t> top{0};
+            alignas(64) atomic<int64_t> bottom{0};
+            atomic<ObjMeta*> buf[Capacity];
+        };
+
+        struct alignas(64) MarkWorker {
+            MarkDeque deque;
+            vector<ObjMeta*> overflow; // private, used when the deque is full
+            vector<ObjMeta*> nurserySurvivors;
+            HeapStats::Count marked;
+            vector<pair<ObjMeta*, const PtrBase*>> adopted; // sub pointers found in the roots
+        };
+
+        static_assert(
+            sizeof(atomic<uint16_t>) == sizeof(uint16_t) && atomic<uint16_t>::is_always_lock_free,
+            "mark epochs are claimed in place");
+
+        // Marks an unmarked object, returns false if it was already marked by any worker.
+        static bool claim(ObjMeta* m, uint16_t epoch) {
+            auto& markEpoch = reinterpret_cast<atomic<uint16_t>&>(m->markEpoch);
+            auto expected = markEpoch.load(memory_order_relaxed);
+            return expected != epoch && markEpoch.compare_exchange_strong(expected, epoch, memory_order_relaxed);
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+
+        Collector* Collector::get() {
+            static once_flag created;
+            call_once(created, [] {
+#ifdef _WIN32
+                _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+#endif
+
+                inst = create();
+                atexit([] { destroy(inst); });
+            });
+            return inst;
+        }
+
+        Collector* Collector::current() {
+            if (auto* c = currentHeap)
+                return c;
+            return inst ? inst : get();
+        }
+
+        Collector* Collector::setCurrent(Collector* c) {
+            auto* prev = current();
+            currentHeap = c;
+            return prev;
+        }
+
+        Collector* Collector::create() {
+            lock_guard<mutex> lk(heapsMtx);
+            for (size_t i = 0; i < MaxHeaps; i++) {
+                if (!heaps[i]) {
+                    auto* c = new Collector();
+                    c->index = (unsigned char)i;
+                    c->id = ++lastHeapId;
+                    heaps[i] = c;
+                    return c;
+                }
+            }
+            throw std::runtime_error("too many garbage collector heaps");
+        }
+
+        void Collector::destroy(Collector* c) {
+            assert(c == inst || currentHeap != c);
+            auto idx = c->index;
+            delete c;
+            lock_guard<mutex> lk(heapsMtx);
+            heaps[idx] = nullptr;
+        }
+
+        Collector::Scope::Scope(Collector* heap) : c(heap), prev(current()) {
+            if (prev != c) {
+                prev->enterSafeRegion();
+                currentHeap = c;
+                c->leaveSafeRegion();
+            }
+        }
+
+        Collector::Scope::~Scope() {
+            if (prev != c) {
+                c->enterSafeRegion();
+                currentHeap = prev;
+                prev->leaveSafeRegion();
+            }
+        }
+
+        Collector::Collector() {
+            roots.reserve(1024 * 10);
+            remembered.reserve(1024 * 10);
+            temp.reserve(1024 * 10);
+            gcCond = new GcCondition_Adaptive;
+#ifdef TGC_MULTI_THREADED
+            // Mutators may release blocks while allocating.
+            pages.concurrent = true;
+#endif
+        }
+
+        Collector::~Collector() {
+#ifdef TGC_MULTI_THREADED
+            // Other threads are gone, the exiting one is not a registered mutator anymore.
+            worldOwner = this_thread::get_id();
+            worldLockDepth = 1;
+            syncMutators();
+#endif
+            // Destructors allocate in the destroyed heap, without collecting it.
+            destroying = true;
+            pages.limit = 0;
+            auto* prevHeap = setCurrent(this);
+            finishSweep();
+            runFinalizers();
+            while (newGen.size()) {
+                auto i = newGen.back();
+                newGen.pop_back();
+                delete i;
+            }
+            while (oldGen.size()) {
+                auto i = oldGen.back();
+                oldGen.pop_back();
+                delete i;
+            }
+            for (auto* meta : nurseryFinalizable)
+                meta->finalize();
+            if (phase == Phase::Mark)
+                PtrBase::incrementalMarking--;
+            currentHeap = prevHeap == this ? nullptr : prevHeap;
+
+            delete markWorkers;
+            delete sweeper;
+            delete gcCond;
+            delete listener;
+            if (recorder) {
+                PtrBase::recordingHeaps--;
+                delete recorder;
+            }
+#ifdef TGC_MULTI_THREADED
+            for (size_t i = 0; i < mutatorCnt; i++)
+                delete mutators[i];
+#endif
+        }
+
+#ifdef TGC_MULTI_THREADED
+        // Mutators of the calling thread, one per heap it has used.
+        struct MutatorSlot {
+            uint64_t heapId = 0;
+            Mutator* m = nullptr;
+        };
+
+        static thread_local MutatorSlot currentMutators[Collector::MaxHeaps];
+
+        Mutator* Collector::currentMutator() {
+            auto& slot = currentMutators[index];
+            return slot.heapId == id ? slot.m : nullptr;
+        }
+
+        Mutator& Collector::mutator() {
+            auto* m = currentMutator();
+            if (!m) {
+                registerMutator();
+                m = currentMutator();
+            }
+            return *m;
+        }
+
+        void Collector::registerMutator() {
+            // Hands the mutators back once the thread exits.
+            thread_local struct Exit {
+                ~Exit() {
+                    for (size_t i = 0; i < MaxHeaps; i++) {
+                        auto& slot = currentMutators[i];
+                        if (slot.m && heaps[i] && heaps[i]->id == slot.heapId)
+                            heaps[i]->unregisterMutator(slot.m);
+                        slot = MutatorSlot();
+                    }
+                }
+            } exitGuard;
+
+            unique_lock<mutex> lk(safepointMtx);
+            // The mutators are enumerated while the world is stopped.
+            safepointCv.wait(lk, [&] { return !stopRequested.load(); });
+            Mutator* m;
+            if (exitedMutators.size()) {
+                m = exitedMutators.back();
+                exitedMutators.pop_back();
+            } else {
+                if (mutatorCnt == MaxMutators)
+                    throw std::runtime_error("too many threads are using the garbage collector");
+                m = new Mutator();
+                m->index = (unsigned short)mutatorCnt;
+                mutators[mutatorCnt++] = m;
+            }
+            m->state = Mutator::State::Running;
+            currentMutators[index] = {id, m};
+        }
+
+        // The pending entries and counters of the thread stay in the mutator until the next
+        // stop of the world, a thread reusing it keeps appending to them.
+        void Collector::unregisterMutator(Mutator* m) {
+            unique_lock<mutex> lk(safepointMtx);
+            // A stopped world reads the mutator, a running thread lets the stop complete
+            // (see `enterSafeRegion`) and hands the mutator back once the world runs again.
+            if (m->state.load() != Mutator::State::Safe) {
+                m->state = Mutator::State::Safe;
+                safepointCv.notify_all();
+            }
+            safepointCv.wait(lk, [&] { return !stopRequested.load(); });
+            m->lastAllocated = nullptr;
+            exitedMutators.push_back(m);
+        }
+
+        // A thread that has not used the heap yet is registered by its first use.
+        void Collector::enterSafeRegion() {
+            auto* m = currentMutator();
+            if (!m)
+                return;
+            {
+                lock_guard<mutex> lk(safepointMtx);
+                m->state = Mutator::State::Safe;
+            }
+            safepointCv.notify_all();
+        }
+
+        void Collector::leaveSafeRegion() {
+            auto* m = currentMutator();
+            if (!m)
+                return;
+            unique_lock<mutex> lk(safepointMtx);
+            safepointCv.wait(lk, [&] { return !stopRequested.load(); });
+            m->state = Mutator::State::Running;
+        }
+
+        void Collector::safepointSlow() {
+            // Destructors and allocations of the collecting thread itself.
+            if (isCollectorThread())
+                return;
+            enterSafeRegion();
+            leaveSafeRegion();
+        }
+
+        void Collector::lockWorld() {
+            auto self = this_thread::get_id();
+            if (worldOwner.load(memory_order_relaxed) == self) {
+                worldLockDepth++;
+                return;
+            }
+
+            // Registered before stopping the world, the collecting thread may allocate too.
+            mutator();
+            // Not waited for by a collection running on another thread meanwhile.
+            enterSafeRegion();
+            worldMtx.lock();
+            {
+                unique_lock<mutex> lk(safepointMtx);
+                stopRequested = true;
+                safepointCv.wait(lk, [&] {
+                    for (size_t i = 0; i < mutatorCnt; i++) {
+                        if (mutators[i]->state.load() == Mutator::State::Running)
+                            return false;
+                    }
+                    return true;
+                });
+            }
+            worldOwner = self;
+            worldLockDepth = 1;
+            syncMutators();
+        }
+
+        void Collector::unlockWorld() {
+            if (--worldLockDepth)
+                return;
+            worldOwner = thread::id();
+            {
+                lock_guard<mutex> lk(safepointMtx);
+                stopRequested = false;
+            }
+            safepointCv.notify_all();
+            worldMtx.unlock();
+            leaveSafeRegion();
+        }
+
+        void Collector::syncMutators() {
+            forEachMutator([&](Mutator& m) {
+                m.pendingRoots.moveTo(roots);
+                m.pendingRemembered.moveTo(remembered);
+                nurseryFinalizable.insert(nurseryFinalizable.end(), m.nurseryFinalizable.begin(), m.nurseryFinalizable.end());
+                m.nurseryFinalizable.clear();
+                nurserySurvivors.insert(nurserySurvivors.end(), m.nurserySurvivors.begin(), m.nurserySurvivors.end());
+                m.nurserySurvivors.clear();
+                grey.insert(grey.end(), m.grey.begin(), m.grey.end());
+                m.grey.clear();
+                if (m.stats.allocated.objects || m.stats.freed.objects) {
+                    for (auto& cs : m.classStats) {
+                        if (cs.klass) {
+                            statsOf(classStats, cs.klass) += cs;
+                            cs = ClassStats();
+                        }
+                    }
+                }
+                stats.nursery += m.stats.nursery;
+                stats.young += m.stats.young;
+                stats.old += m.stats.old;
+                stats.allocated += m.stats.allocated;
+                stats.freed += m.stats.freed;
+                m.stats = HeapStats();
+            });
+            // Drop the entries cleared by the mutators.
+            roots.compact();
+            remembered.compact();
+        }
+#endif
+
+        void Collector::addRoot(const PtrBase* p) {
+#ifdef TGC_MULTI_THREADED
+            if (!isCollectorThread()) {
+                auto& m = mutator();
+                if (!m.pendingRoots.add(p, m.index)) {
+                    // The log is full, it is moved to the table while the world is stopped.
+                    WorldLock lk(this);
+                    roots.add(p);
+                }
+                return;
+            }
+#endif
+            roots.add(p);
+        }
+
+        void Collector::addRemembered(const PtrBase* p) {
+#ifdef TGC_MULTI_THREADED
+            if (!isCollectorThread()) {
+                auto& m = mutator();
+                if (!m.pendingRemembered.add(p, m.index)) {
+                    WorldLock lk(this);
+                    remembered.add(p);
+                }
+                return;
+            }
+#endif
+            remembered.add(p);
+        }
+
+        void Collector::removePtr(const PtrBase* p) {
+            auto& table = p->isRoot ? roots : remembered;
+#ifdef TGC_MULTI_THREADED
+            // The pointer may have been created by another thread.
+            if (PendingLog::isPending(p)) {
+                auto* m = mutators[PendingLog::mutatorOf(p)];
+                (p->isRoot ? m->pendingRoots : m->pendingRemembered).clear(p);
+                return;
+            }
+            if (!isCollectorThread()) {
+                table.clear(p);
+                return;
+            }
+#endif
+            table.remove(p);
+        }
+
+        void Collector::shadeFromMutator(ObjMeta* meta) {
+#ifdef TGC_MULTI_THREADED
+            // Other mutators may shade the same object, the collector scans it at its next step.
+            if (!isCollectorThread()) {
+                if (claim(meta, markEpoch)) {
+                    auto& m = mutator();
+                    if (meta->inNursery)
+                        m.nurserySurvivors.push_back(meta);
+                    m.grey.push_back(meta);
+                }
+                return;
+            }
+#endif
+            shade(meta);
+        }
+
+        // Objects under construction are only referenced by the stack of their thread. They are
+        // shaded by incremental collections, queued for `markPending` by the other ones.
+        void Collector::markCreating() {
+            auto markObj = [&](ObjMeta* meta) {
+                if (phase == Phase::Mark)
+                    shade(meta);
+                else
+                    temp.push_back(meta);
+            };
+            forEachMutator([&](Mutator& m) {
+                for (auto* meta : m.creatingObjs)
+                    markObj(meta);
+                for (auto* meta : m.creatingDeclared)
+                    markObj(meta);
+#ifdef TGC_MULTI_THREADED
+                // Another thread may have been stopped before storing its new object, while the
+                // collecting thread itself is not in the middle of a `gc_new` (and its last object
+                // may be freed now).
+                if (&m == currentMutator())
+                    m.lastAllocated = nullptr;
+                else if (m.lastAllocated)
+                    markObj(m.lastAllocated);
+#endif
+            });
+        }
+
+        // Registers a new object, nothing is left registered if it throws.
+        void Collector::addMeta(ObjMeta* meta) {
+            countAlloc(meta);
+            newGen.push_back(meta);
+            // Allocated marked, scanned once constructed.
+            meta->markEpoch = markEpoch;
+            try {
+                if (phase == Phase::Mark) {
+                    if (isCollectorThread())
+                        grey.push_back(meta);
+#ifdef TGC_MULTI_THREADED
+                    else
+                        mutator().grey.push_back(meta);
+#endif
+                }
+                addCreatingMeta(meta);
+                if (meta->klass->isContainer)
+                    youngContainers.insert(meta);
+            } catch (...) {
+                vector_remove(grey, meta);
+#ifdef TGC_MULTI_THREADED
+                vector_remove(mutator().grey, meta);
+#endif
+                vector_remove(mutator().creatingObjs, meta);
+                newGen.remove(meta);
+                objDestroyed(meta);
+                throw;
+            }
+        }
+
+        void Collector::addCreatingMeta(ObjMeta* meta) {
+            if (recorder)
+                recorder->alloc(meta);
+            auto& m = mutator();
+            if (meta->klass->declared)
+                m.creatingDeclared.push_back(meta);
+            else
+                m.creatingObjs.push_back(meta);
+        }
+
+        // If it throws, the object is left dead in its page like a failed construction
+        // (see `ClassMeta::endNewMeta`), the block is reclaimed with the page.
+        void Collector::addNurseryMeta(ObjMeta* meta) {
+            // Nursery objects start unmarked and are only marked when reached by a collection.
+            meta->inNursery = true;
+            countAlloc(meta);
+            try {
+                if (phase == Phase::Mark)
+                    shadeFromMutator(meta);
+                if (!meta->klass->trivialDctor) {
+                    if (isCollectorThread())
+                        nurseryFinalizable.push_back(meta);
+#ifdef TGC_MULTI_THREADED
+                    else
+                        mutator().nurseryFinalizable.push_back(meta);
+#endif
+                }
+                addCreatingMeta(meta);
+            } catch (...) {
+                objDestroyed(meta);
+                meta->arrayLength = 0;
+                throw;
+            }
+        }
+
+        // Counters changed by the calling thread, mutators keep the changes until `syncMutators`.
+        HeapStats& Collector::localStats() {
+#ifdef TGC_MULTI_THREADED
+            if (!isCollectorThread())
+                return mutator().stats;
+#endif
+            return stats;
+        }
+
+        vector<ClassStats>& Collector::localClassStats() {
+#ifdef TGC_MULTI_THREADED
+            if (!isCollectorThread())
+                return mutator().classStats;
+#endif
+            return classStats;
+        }
+
+        ClassStats& Collector::statsOf(vector<ClassStats>& table, ClassMeta* klass) {
+            if (klass->id >= table.size())
+                table.resize(klass->id + 1);
+            auto& s = table[klass->id];
+            s.klass = klass;
+            return s;
         }
 
-        void ObjMeta::operator delete(void* p) {
-            auto* m = (ObjMeta*)p;
-            m->klass->callDealloc(m);
+        void Collector::countAlloc(ObjMeta* meta) {
+            auto n = meta->blockSize();
+            auto& cs = statsOf(localClassStats(), meta->klass); // the only step that may throw
+            auto& s = localStats();
+            s.allocated.add(n);
+            (meta->inNursery ? s.nursery : s.young).add(n);
+            if (!meta->inNursery)
+                allocatedOutOfNursery.fetch_add(n, std::memory_order_relaxed);
+            cs.allocated++;
+            cs.live.add(n);
+            if (meta->inNursery)
+                cs.nursery.add(n);
         }
 
-        bool ObjMeta::containsPtr(char* p) {
-            auto* o = objPtr();
-            return o <= p && p < o + klass->size * arrayLength;
+        // Counts a live object destroyed before it dies.
+        void Collector::objDestroyed(ObjMeta* meta) {
+            auto n = meta->blockSize();
+            auto& s = localStats();
+            (meta->inNursery ? s.nursery : meta->isOld ? s.old : s.young).sub(n);
+            s.freed.add(n);
+            auto& cs = statsOf(localClassStats(), meta->klass);
+            cs.freed++;
+            cs.live.sub(n);
+            if (meta->inNursery)
+                cs.nursery.sub(n);
         }
 
-        //////////////////////////////////////////////////////////////////////////
+        // Counts an object of a generation list found dead by the collector thread.
+        void Collector::countDead(ObjMeta* meta) {
+            if (!meta->arrayLength)
+                return; // destroyed already
+            auto n = meta->blockSize();
+            (meta->isOld ? stats.old : stats.young).sub(n);
+            stats.freed.add(n);
+            stats.lastFreed.add(n);
+            auto& cs = statsOf(classStats, meta->klass);
+            cs.freed++;
+            cs.live.sub(n);
+        }
 
-        PtrBase* ObjPtrEnumerator::getNext() {
-            assert(klass->registered);
-            if (auto* subPtrs = klass->subPtrOffsets) {
-                if (arrayElemIdx < len && subPtrIdx < subPtrs->size()) {
-                    auto* obj = base + arrayElemIdx * klass->size;
-                    auto* subPtr = obj + (*klass->subPtrOffsets)[subPtrIdx];
-                    if (++subPtrIdx >= klass->subPtrOffsets->size()) {
-                        arrayElemIdx++;
-                        subPtrIdx = 0;
-                    }
-                    return (PtrBase*)subPtr;
+        // Pointers constructed inside an object under construction are sub pointers, the other
+        // ones are roots. Pointers outside of the gc heap (e.g. on the stack) are told apart in O(1).
+        // Returns the owner of a sub pointer.
+        ObjMeta* Collector::tryRegisterToClass(PtrBase* p) {
+            auto& m = mutator();
+            if (m.isCreatingObj == 0 || (!ClassMeta::alloc && !PageAllocator::contains(p)))
+                return nullptr;
+            // The owner may have been promoted by collections run while it was constructed
+            // (e.g. on other threads), stores into its new pointers then need the barrier.
+            // Constructions nest, so only the innermost declared object can own the pointer
+            // and its layout is already known. Members left out of `TGC_FIELDS` are never
+            // traced, they stay roots.
+            if (m.creatingDeclared.size() && m.creatingDeclared.back()->containsPtr((char*)p)) {
+                auto* owner = m.creatingDeclared.back();
+                if (!isDeclaredField(owner, p))
+                    return nullptr;
+                p->isRoot = false;
+                p->isOld = owner->isOld;
+                return owner;
+            }
+            // owner may not be the current one(e.g. constructor recursed)
+            for (auto i = m.creatingObjs.rbegin(); i != m.creatingObjs.rend(); ++i) {
+                auto* owner = *i;
+                if (owner->containsPtr((char*)p)) {
+                    if (!owner->klass->registered)
+                        owner->klass->registerSubPtr(owner, p);
+                    p->isRoot = false;
+                    p->isOld = owner->isOld;
+                    return owner;
                 }
             }
             return nullptr;
         }
 
-        //////////////////////////////////////////////////////////////////////////
+        void Collector::cleanRemembered() {
+            // Only keep slots still pointing into the young generation.
+            for (auto i = remembered.size(); i-- > 0;) {
+                auto* ptr = remembered[i];
+                if (!ptr->meta || ptr->meta->isOld)
+                    remembered.remove(ptr);
+            }
+        }
 
-        PtrBase::PtrBase() : isOld(false), isRoot(true) {
-            auto* c = Collector::inst ? Collector::inst : Collector::get();
-            c->tryRegisterToClass(this);
+        ObjMeta* Collector::globalFindOwnerMeta(void* obj) {
+            // The header of a block outside of the gc heap may not be readable.
+            if (!ClassMeta::alloc && !PageAllocator::contains(obj))
+                return nullptr;
+            auto* meta = (ObjMeta*)((char*)obj - sizeof(ObjMeta));
+            if (meta->magic == ObjMeta::Magic)
+                return meta;
+            else
+                return nullptr;
         }
 
-        PtrBase::PtrBase(void* obj) : isOld(false), isRoot(true) {
-            auto* c = Collector::inst ? Collector::inst : Collector::get();
-            c->tryRegisterToClass(this);
-            meta = c->globalFindOwnerMeta(obj);
-            if (!meta) {
-                throw std::runtime_error("unable to construct gc pointer, this usually happens when you "
-                                         "are trying to construct a gc pointer from a raw pointer, this "
-                                         "is not supported");
+        // Unmarks every object. A stale epoch must never become current again, so every
+        // object is reset once all epochs are used.
+        void Collector::nextEpoch() {
+            if (++markEpoch)
+                return;
+            for (auto* meta : newGen)
+                meta->markEpoch = 0;
+            for (auto* meta : oldGen)
+                meta->markEpoch = 0;
+            markEpoch = 1;
+        }
+
+        // Marks everything reachable from the objects in `temp`. Children are queued without
+        // reading their header: it is prefetched when they enter a small FIFO and only read
+        // when they leave it, after the objects ahead of them are scanned.
+        void Collector::markPending() {
+            constexpr size_t PrefetchDistance = 8;
+            ObjMeta* fifo[PrefetchDistance];
+            size_t head = 0, cnt = 0;
+
+            // Minor collections do not scan the old generation.
+            auto isUnmarked = [&](ObjMeta* m) { return m->markEpoch != markEpoch && (full || !m->isOld); };
+            while (temp.size() || cnt) {
+                if (temp.size() && cnt < PrefetchDistance) {
+                    auto* m = temp.back();
+                    temp.pop_back();
+                    prefetch(m);
+                    fifo[(head + cnt++) % PrefetchDistance] = m;
+                    continue;
+                }
+
+                auto* meta = fifo[head];
+                head = (head + 1) % PrefetchDistance;
+                cnt--;
+                if (!isUnmarked(meta))
+                    continue;
+                meta->markEpoch = markEpoch;
+                marked.add(meta->blockSize());
+                if (meta->inNursery)
+                    nurserySurvivors.push_back(meta);
+                forEachSubPtr(meta, [&](const PtrBase* child) {
+                    if (child->isRoot)
+                        adoptSubPtr(meta, child);
+                    if (auto* m = child->meta)
+                        temp.push_back(m);
+                });
             }
-            writeBarrier();
         }
 
-        PtrBase::~PtrBase() {
-            auto* c = Collector::inst;
-            c->unrefs.emplace_back(this);
+        // Adopted sub pointers leave the roots while marking, so all roots are queued first.
+        void Collector::queueRoots() {
+            for (auto ptr : roots) {
+                if (ptr->meta)
+                    temp.push_back(ptr->meta);
+            }
         }
 
-        void PtrBase::writeBarrier() {
-            if (this->meta)
-                Collector::inst->delayIntergenerationalPtrs.insert(this);
+        // Sub pointers constructed outside of their owner (e.g. in a container node) are
+        // registered as roots until the owner is scanned.
+        void Collector::adoptSubPtr(ObjMeta* owner, const PtrBase* p) {
+            if (p->slot != SlotTable::NoSlot)
+                roots.remove(p);
+            p->isRoot = false;
+            p->isOld = owner->isOld;
+            if (p->isOld && p->meta)
+                remembered.add(p);
         }
 
-        //////////////////////////////////////////////////////////////////////////
+        // Adopts the elements of the young (and `old`) containers before the roots are scanned,
+        // so the elements of a dead container do not keep their objects alive. Containers under
+        // construction are skipped, they may not be traceable yet.
+        void Collector::adoptElems(bool old) {
+            vector<ObjMeta*> constructing;
+            forEachMutator([&](Mutator& m) {
+                constructing.insert(constructing.end(), m.creatingObjs.begin(), m.creatingObjs.end());
+            });
+            auto adopt = [&](ObjMeta* meta) {
+                if (find(constructing.begin(), constructing.end(), meta) != constructing.end())
+                    return;
+                forEachSubPtr(meta, [&](const PtrBase* p) {
+                    if (p->isRoot)
+                        adoptSubPtr(meta, p);
+                });
+            };
+            for (auto* meta : youngContainers)
+                adopt(meta);
+            if (old) {
+                for (auto* meta : oldContainers)
+                    adopt(meta);
+            }
+        }
 
-        ObjMeta* ClassMeta::newMeta(size_t cnt) {
-            auto* c = Collector::inst ? Collector::inst : Collector::get();
+        void Collector::minorCollect() {
+            WorldLock lk(this);
+            Pause pause(this);
+            if (recorder && pauseDepth == 1)
+                recorder->collect(AllocTraceEvent::CollectKind::Minor, {});
+            finishSweep();
+            finishCycle();
+            stats.lastFreed = HeapStats::Count();
+            beginCollection(GcEvent::Kind::Minor);
+            beginPhase(GcEvent::Phase::Finalize);
+            runFinalizers();
+            endPhase();
+            stats.minorCollections++;
+            nextEpoch();
+
+            beginPhase(GcEvent::Phase::Roots);
+            adoptElems(false);
+            queueRoots();
+            markCreating();
+            for (auto ptr : remembered) {
+                if (ptr->meta)
+                    temp.push_back(ptr->meta);
+            }
+            endPhase();
 
-            // This garbage collects `ObjMeta` while it is in the `creatingObjs` array
-            // and we then crash because accessing deleted memory.
-            // if (c->gcCond && c->gcCond->needMinorGc(c))
-            //     c->collect();
+            beginPhase(GcEvent::Phase::Mark);
+            markPending();
+            endPhase();
 
-            ObjMeta* meta = nullptr;
-            try {
-                isCreatingObj++;
-                auto* p = callAlloc(size * cnt + sizeof(ObjMeta));
-                meta = new (p) ObjMeta(this, p + sizeof(ObjMeta), cnt);
-                // Allow using gc_from(this) in the constructor of the creating object.
-                c->addMeta(meta);
-                return meta;
-            } catch (std::bad_alloc&) {
-                if (meta)
-                    callDealloc(meta);
-                throw;
-            }
+            beginPhase(GcEvent::Phase::Sweep);
+            sweepNursery();
+            sweep(newGen);
+            cleanRemembered();
+            endPhase();
+            endCollection();
         }
 
-        void ClassMeta::endNewMeta(ObjMeta* meta, bool failed) {
-            auto* c = Collector::inst;
-            isCreatingObj--;
-            vector_remove(c->creatingObjs, meta);
-            if (failed) {
-                c->newGen.remove(meta);
-                callDealloc(meta);
+        void Collector::sweep(MetaSet& gen) {
+            for (auto* meta = *gen.begin(); meta;)
+                meta = sweepObj(gen, meta);
+
+            if (trace)
+                printf("sweep %s, free cnt:%zu\n", &gen == &oldGen ? "old" : "new", stats.lastFreed.objects);
+        }
+
+        // Frees or ages the object, returns the next one of its generation.
+        ObjMeta* Collector::sweepObj(MetaSet& gen, ObjMeta* meta) {
+            auto* next = MetaSet::next(meta);
+            if (meta->markEpoch != markEpoch) {
+                countDead(meta);
+                gen.remove(meta);
+                delete meta;
             } else {
-                meta->klass->registered = true;
+                statsOf(classStats, meta->klass).survived++;
+                if (!full && ++meta->scanCountInNewGen >= scanCountToOldGen) {
+                    meta->scanCountInNewGen = 0;
+                    newGen.remove(meta);
+                    promote(meta);
+                }
             }
+            return next;
         }
 
-        void ClassMeta::registerSubPtr(ObjMeta* owner, PtrBase* p) {
-            auto offset = (OffsetType)((char*)p - owner->objPtr());
-            if (!subPtrOffsets) {
-                subPtrOffsets = new vector<OffsetType>();
-                subPtrOffsets->push_back(offset);
-            } else if (offset > subPtrOffsets->back()) { // constructor recursived
-                subPtrOffsets->push_back(offset);
+        void Collector::sweepNursery() {
+            // Swap everything out first: destructors may allocate new nursery objects.
+            vector<ObjMeta*> finalizable, survivors;
+            finalizable.swap(nurseryFinalizable);
+            survivors.swap(nurserySurvivors);
+            auto detached = nursery.detachPages();
+            allocatedOutOfNursery.store(0, std::memory_order_relaxed);
+            forEachMutator([](Mutator& m) { m.tlab = Nursery::AllocationBuffer(); });
+
+            // Pin survivors into their pages, they are aged by the following `sweep(newGen)`.
+            for (auto* meta : survivors) {
+                auto n = meta->blockSize();
+                if (meta->arrayLength) {
+                    stats.nursery.sub(n);
+                    stats.young.add(n);
+                    statsOf(classStats, meta->klass).nursery.sub(n);
+                }
+                meta->inNursery = false;
+                Nursery::pin(detached, meta, n);
+                newGen.push_back(meta);
+            }
+            // Every other nursery object is dead.
+            stats.freed += stats.nursery;
+            stats.lastFreed += stats.nursery;
+            stats.nursery = HeapStats::Count();
+            for (auto& cs : classStats) {
+                if (cs.nursery.objects) {
+                    cs.freed += cs.nursery.objects;
+                    cs.live -= cs.nursery;
+                    cs.nursery = HeapStats::Count();
+                }
             }
-        }
 
-        //////////////////////////////////////////////////////////////////////////
+            // Unmarked objects die, only non-trivial destructors need a visit.
+            for (auto* meta : finalizable) {
+                if (meta->markEpoch != markEpoch)
+                    meta->finalize();
+            }
 
-        Collector* Collector::get() {
-            if (!inst) {
-#ifdef _WIN32
-                _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
-#endif
+            // All remaining memory of the detached pages is dead.
+            nursery.recyclePages(detached);
 
-                inst = new Collector();
-                atexit([] { delete inst; });
-            }
-            return inst;
+            if (trace)
+                printf("sweep nursery, survivors:%zu\n", survivors.size());
         }
 
-        Collector::Collector() {
-            roots.reserve(1024 * 10);
-            unrefs.reserve(1024 * 10);
-            temp.reserve(1024 * 10);
-            intergenerationalPtrs.reserve(1024 * 10);
-            delayIntergenerationalPtrs.reserve(1024 * 10);
-            setGcCondition(new GcCondition_Time);
+        void Collector::promote(ObjMeta* meta) {
+            if (meta->arrayLength) {
+                auto n = meta->blockSize();
+                stats.young.sub(n);
+                stats.old.add(n);
+                stats.promoted.add(n);
+                statsOf(classStats, meta->klass).promoted++;
+            }
+            meta->isOld = true;
+            oldGen.push_back(meta);
+            if (meta->klass->isContainer && youngContainers.erase(meta))
+                oldContainers.insert(meta);
+            forEachSubPtr(meta, [&](const PtrBase* p) {
+                if (p->isRoot)
+                    return;
+                p->isOld = true;
+                if (p->meta && !p->meta->isOld && p->slot == SlotTable::NoSlot)
+                    remembered.add(p);
+            });
         }
 
-        Collector::~Collector() {
-            while (newGen.size()) {
-                auto i = newGen.back();
-                newGen.pop_back();
-                delete i;
-            }
-            while (oldGen.size()) {
-                auto i = oldGen.back();
-                oldGen.pop_back();
-                delete i;
+        void Collector::fullCollect() {
+            WorldLock lk(this);
+            Pause pause(this);
+            if (recorder && pauseDepth == 1)
+                recorder->collect(AllocTraceEvent::CollectKind::Full, {});
+            finishSweep();
+            finishCycle();
+            stats.lastFreed = HeapStats::Count();
+            beginCollection(GcEvent::Kind::Full);
+            beginPhase(GcEvent::Phase::Finalize);
+            runFinalizers();
+            endPhase();
+            stats.fullCollections++;
+            full = true;
+            nextEpoch();
+
+            // Parallel workers scan the roots themselves.
+            beginPhase(GcEvent::Phase::Roots);
+            adoptElems(true);
+            markCreating();
+            if (!markWorkers)
+                queueRoots();
+            endPhase();
+
+            beginPhase(GcEvent::Phase::Mark);
+            markPending();
+            if (markWorkers)
+                markParallel();
+            endPhase();
+
+            beginPhase(GcEvent::Phase::Sweep);
+            sweepNursery();
+            // Before the sweeper starts freeing the dead young objects remembered by dead old ones.
+            cleanRemembered();
+            if (backgroundSweep) {
+                // Dead objects are not reachable anymore, so the sweeper only races with
+                // the mutator on the allocator and the finalization queue.
+                sweepingNewGen = newGen;
+                sweepingOldGen = oldGen;
+                newGen = MetaSet();
+                oldGen = MetaSet();
+                swept = HeapStats();
+                sweptClasses.clear();
+                pages.concurrent = true;
+                if (!sweeper)
+                    sweeper = new BackgroundWorker;
+                sweeping = true;
+                sweeper->start([this] {
+                    sweepInBackground(sweepingNewGen);
+                    sweepInBackground(sweepingOldGen);
+                });
+            } else {
+                sweep(newGen);
+                sweep(oldGen);
             }
-            for (auto* i : IPtrEnumerator::buf)
-                delete[] i;
-
-            delete gcCond;
+            full = false;
+            endPhase();
+            endCollection();
         }
 
-        void Collector::addMeta(ObjMeta* meta) {
-            newGen.push_back(meta);
-            creatingObjs.push_back(meta);
+        void Collector::setBackgroundSweep(bool enabled) {
+            WorldLock lk(this);
+            finishSweep();
+            backgroundSweep = enabled;
         }
 
-        void Collector::tryRegisterToClass(PtrBase* p) {
-            if (ClassMeta::isCreatingObj > 0) {
-                // owner may not be the current one(e.g. constructor recursed)
-                for (auto i = creatingObjs.rbegin(); i != creatingObjs.rend(); ++i) {
-                    auto* owner = *i;
-                    if (!owner->klass->registered && owner->containsPtr((char*)p)) {
-                        owner->klass->registerSubPtr(owner, p);
-                        break;
+        // Runs on the sweeper thread, the generation is detached and no object of it is marked
+        // or promoted meanwhile (collections wait for `finishSweep`).
+        void Collector::sweepInBackground(MetaSet& gen) {
+            constexpr size_t BatchSize = 256;
+            vector<ObjMeta*> finalizable;
+            auto publish = [&] {
+                lock_guard<mutex> lk(finalizeMtx);
+                sweptFinalizable.insert(sweptFinalizable.end(), finalizable.begin(), finalizable.end());
+                finalizable.clear();
+            };
+
+            for (auto* meta = *gen.begin(); meta;) {
+                auto* next = MetaSet::next(meta);
+                if (meta->markEpoch != markEpoch) {
+                    gen.remove(meta);
+                    if (meta->arrayLength) {
+                        auto n = meta->blockSize();
+                        (meta->isOld ? swept.old : swept.young).add(n);
+                        auto& cs = statsOf(sweptClasses, meta->klass);
+                        cs.freed++;
+                        cs.live.sub(n);
+                    }
+                    // A custom `dealloc` may not be thread safe.
+                    if (meta->klass->trivialDctor && !ClassMeta::dealloc) {
+                        ClassMeta::callDealloc(meta);
+                    } else {
+                        finalizable.push_back(meta);
+                        if (finalizable.size() == BatchSize)
+                            publish();
                     }
+                } else {
+                    statsOf(sweptClasses, meta->klass).survived++;
                 }
+                meta = next;
             }
+            publish();
         }
 
-        void Collector::handleUnrefs() {
-            for (auto ptr : unrefs) {
-                intergenerationalPtrs.erase(ptr);
-                delayIntergenerationalPtrs.erase(ptr);
-                roots.erase(ptr);
+        void Collector::finishSweep() {
+            WorldLock lk(this);
+            if (!sweeping)
+                return;
+            sweeper->wait();
+            sweeping = false;
+#ifndef TGC_MULTI_THREADED
+            pages.concurrent = false;
+#endif
+
+            // Survivors are older than the objects allocated meanwhile.
+            sweepingNewGen.append(newGen);
+            newGen = sweepingNewGen;
+            sweepingNewGen = MetaSet();
+            sweepingOldGen.append(oldGen);
+            oldGen = sweepingOldGen;
+            sweepingOldGen = MetaSet();
+            stats.young -= swept.young;
+            stats.old -= swept.old;
+            for (auto& count : {swept.young, swept.old}) {
+                stats.freed += count;
+                stats.lastFreed += count;
             }
-            unrefs.clear();
+            for (auto& cs : sweptClasses) {
+                if (cs.klass)
+                    statsOf(classStats, cs.klass) += cs;
+            }
+
+            if (trace)
+                printf("background sweep, free cnt:%zu\n", swept.young.objects + swept.old.objects);
         }
 
-        void Collector::handleDelayIntergenerationalPtrs() {
-            for (auto* p : delayIntergenerationalPtrs) {
-                if (p->isRoot)
-                    roots.insert(p);
-                else if (p->isOld) {
-                    intergenerationalPtrs.insert(p);
-                }
+        size_t Collector::runFinalizers(size_t maxCnt) {
+            WorldLock lk(this);
+            {
+                lock_guard<mutex> lk(finalizeMtx);
+                finalizeQueue.insert(finalizeQueue.end(), sweptFinalizable.begin(), sweptFinalizable.end());
+                sweptFinalizable.clear();
+            }
+            // Pop before deleting, a destructor may run a collection draining the queue too.
+            for (size_t i = 0; i < maxCnt && finalizeQueue.size(); i++) {
+                auto* meta = finalizeQueue.back();
+                finalizeQueue.pop_back();
+                delete meta;
             }
-            delayIntergenerationalPtrs.clear();
+            return finalizeQueue.size();
         }
 
-        ObjMeta* Collector::globalFindOwnerMeta(void* obj) {
-            auto* meta = (ObjMeta*)((char*)obj - sizeof(ObjMeta));
-            if (meta->magic == ObjMeta::Magic)
-                return meta;
-            else
-                return nullptr;
+        void Collector::setMarkThreads(unsigned cnt) {
+            WorldLock lk(this);
+            delete markWorkers;
+            markWorkers = cnt > 1 ? new WorkerPool(cnt) : nullptr;
         }
 
-        void Collector::mark(ObjMeta* meta) {
-            auto doMark = [&](ObjMeta* meta) {
-                if (meta->color == ObjMeta::Color::White) {
-                    meta->color = ObjMeta::Color::Black;
+        unsigned Collector::getMarkThreads() {
+            WorldLock lk(this);
+            return markWorkers ? markWorkers->size() : 1;
+        }
+
+        // Element classes of traced containers are registered with the containers, so tracing
+        // does not touch any shared state except the mark epochs. Sub pointers found in the
+        // roots are adopted once all workers are done.
+        void Collector::markParallel() {
+            auto cnt = markWorkers->size();
+            vector<MarkWorker> workers(cnt);
+            atomic<unsigned> idleCnt{0};
+
+            markWorkers->run([&](unsigned idx) {
+                auto& self = workers[idx];
+                auto push = [&](ObjMeta* m) {
+                    if (!self.deque.push(m))
+                        self.overflow.push_back(m);
+                };
+                auto visit = [&](ObjMeta* m) {
+                    if (claim(m, markEpoch)) {
+                        if (m->inNursery)
+                            self.nurserySurvivors.push_back(m);
+                        push(m);
+                    }
+                };
+
+                // Roots are split in even slices.
+                auto first = roots.size() * idx / cnt, last = roots.size() * (idx + 1) / cnt;
+                for (auto i = first; i < last; i++) {
+                    if (auto* m = roots[i]->meta)
+                        visit(m);
+                }
+
+                for (;;) {
+                    ObjMeta* m;
+                    while ((m = self.deque.pop()) || self.overflow.size()) {
+                        if (!m) {
+                            m = self.overflow.back();
+                            self.overflow.pop_back();
+                        }
+                        self.marked.add(m->blockSize());
+                        forEachSubPtr(m, [&](const PtrBase* child) {
+                            if (child->isRoot)
+                                self.adopted.emplace_back(m, child);
+                            if (auto* c = child->meta)
+                                visit(c);
+                        });
+                    }
 
-                    if (auto* ptrIt = meta->klass->enumPtrs(meta)) {
-                        for (; auto* child = ptrIt->getNext();) {
-                            if (auto* m = child->meta) {
-                                if (m->color == ObjMeta::Color::White)
-                                    temp.push_back(m);
+                    // Out of work: an idle worker never creates work, so everything
+                    // is marked once all workers are idle.
+                    idleCnt++;
+                    for (;;) {
+                        if (idleCnt.load() == cnt)
+                            return;
+                        ObjMeta* stolen = nullptr;
+                        for (unsigned i = 1; i < cnt && !stolen; i++) {
+                            auto& victim = workers[(idx + i) % cnt];
+                            if (!victim.deque.empty()) {
+                                idleCnt--;
+                                stolen = victim.deque.steal();
+                                if (!stolen)
+                                    idleCnt++;
                             }
                         }
-                        delete ptrIt;
+                        if (stolen) {
+                            push(stolen);
+                            break;
+                        }
+                        this_thread::yield();
                     }
                 }
-            };
+            });
+
+            for (auto& w : workers) {
+                marked += w.marked;
+                nurserySurvivors.insert(nurserySurvivors.end(), w.nurserySurvivors.begin(), w.nurserySurvivors.end());
+                for (auto& [owner, p] : w.adopted)
+                    adoptSubPtr(owner, p);
+            }
+        }
 
-            doMark(meta);
-            while (temp.size()) {
-                auto* m = temp.back();
-                temp.pop_back();
-                doMark(m);
+        void Collector::shade(ObjMeta* meta) {
+            if (meta->markEpoch != markEpoch) {
+                meta->markEpoch = markEpoch;
+                if (meta->inNursery)
+                    nurserySurvivors.push_back(meta);
+                grey.push_back(meta);
             }
         }
 
-        // Unified way for objects and containers.
-        void Collector::preMark(ObjMeta* meta) {
-            auto work = [&](ObjMeta* meta) {
-                // fix for circular references.
-                if (meta->color == ObjMeta::Color::Black) {
-                    // sweep function cannot reset color of intergenerational objects.
-                    meta->color = ObjMeta::Color::White;
+        bool Collector::collectStep(std::chrono::microseconds budget) {
+            WorldLock lk(this);
+            Pause pause(this);
+            if (recorder && pauseDepth == 1)
+                recorder->collect(AllocTraceEvent::CollectKind::Step, budget);
+            return runCycle(std::chrono::steady_clock::now() + budget);
+        }
 
-                    meta->hasSubPtrs = true;
-                    if (auto* it = meta->klass->enumPtrs(meta)) {
-                        meta->hasSubPtrs = false;
+        void Collector::finishCycle() {
+            if (phase != Phase::Idle)
+                runCycle(std::chrono::steady_clock::time_point::max());
+        }
 
-                        for (; auto* ptr = it->getNext();) {
-                            ptr->isRoot = false;
-                            meta->hasSubPtrs = true;
+        bool Collector::runCycle(std::chrono::steady_clock::time_point deadline) {
+            // The clock is only read every `StepWork` objects.
+            constexpr int StepWork = 64;
+            int work = 0;
+            auto outOfTime = [&] {
+                return ++work % StepWork == 0 && std::chrono::steady_clock::now() >= deadline;
+            };
 
-                            if (auto* subMeta = ptr->meta) {
-                                // fix for circular references.
-                                if (subMeta->color == ObjMeta::Color::Black)
-                                    temp.push_back(ptr->meta);
-                            }
-                        }
-                        delete it;
+            if (phase == Phase::Idle) {
+                finishSweep();
+                stats.lastFreed = HeapStats::Count();
+                beginCollection(GcEvent::Kind::Incremental);
+                beginPhase(GcEvent::Phase::Finalize);
+                runFinalizers();
+                endPhase();
+                nextEpoch();
+                phase = Phase::Mark;
+                beginPhase(GcEvent::Phase::Roots);
+                adoptElems(true);
+                for (auto ptr : roots) {
+                    if (ptr->meta)
+                        shade(ptr->meta);
+                }
+                markCreating();
+                PtrBase::incrementalMarking++;
+                endPhase();
+                beginPhase(GcEvent::Phase::Mark);
+            }
+
+            if (phase == Phase::Mark) {
+                for (;;) {
+                    while (grey.size()) {
+                        auto* meta = grey.back();
+                        grey.pop_back();
+                        marked.add(meta->blockSize());
+                        forEachSubPtr(meta, [&](const PtrBase* child) {
+                            if (child->isRoot)
+                                adoptSubPtr(meta, child);
+                            if (child->meta)
+                                shade(child->meta);
+                        });
+                        if (outOfTime())
+                            return false;
+                    }
+
+                    // Roots are not guarded by the barrier, rescan them atomically.
+                    for (auto ptr : roots) {
+                        if (ptr->meta)
+                            shade(ptr->meta);
                     }
+                    markCreating();
+                    if (grey.empty())
+                        break;
                 }
-            };
 
-            work(meta);
-            while (temp.size()) {
-                auto* m = temp.back();
-                temp.pop_back();
-                work(m);
+                // Objects allocated from now on (e.g. by destructors) are not scanned anymore.
+                PtrBase::incrementalMarking--;
+                endPhase();
+                beginPhase(GcEvent::Phase::Sweep);
+                phase = Phase::Sweep;
+                sweepNursery();
+                full = true;
+                cursorInOld = false;
+                cursor = *newGen.begin();
+            }
+
+            // Phase::Sweep
+            for (;;) {
+                if (!cursor) {
+                    if (cursorInOld)
+                        break;
+                    cursorInOld = true;
+                    cursor = *oldGen.begin();
+                    continue;
+                }
+                cursor = sweepObj(cursorInOld ? oldGen : newGen, cursor);
+                if (outOfTime())
+                    return false;
             }
+
+            full = false;
+            cleanRemembered();
+            stats.fullCollections++;
+            phase = Phase::Idle;
+            endPhase();
+            endCollection();
+            if (trace)
+                printf("incremental collection, free cnt:%zu\n", stats.lastFreed.objects);
+            return true;
         }
 
-        void Collector::minorCollect() {
-            freeObjCntOfPrevGc = 0;
-            newGenGcCount++;
+        size_t PauseHistogram::bucketOf(uint64_t ns) {
+            constexpr uint64_t SubBuckets = 1 << SubBucketBits;
+            if (ns < SubBuckets)
+                return (size_t)ns;
+            int msb = SubBucketBits;
+            while (ns >> (msb + 1))
+                msb++;
+            auto shift = msb - SubBucketBits;
+            return (size_t)(shift + 1) * SubBuckets + ((ns >> shift) & (SubBuckets - 1));
+        }
 
-            for (auto meta : newGen)
-                preMark(meta);
+        uint64_t PauseHistogram::upperBoundOf(size_t bucket) {
+            constexpr uint64_t SubBuckets = 1 << SubBucketBits;
+            if (bucket < SubBuckets)
+                return bucket;
+            auto shift = bucket / SubBuckets - 1;
+            auto lower = (SubBuckets + bucket % SubBuckets) << shift;
+            return lower + ((uint64_t)1 << shift) - 1;
+        }
 
-            handleUnrefs();
-            handleDelayIntergenerationalPtrs();
+        void PauseHistogram::record(std::chrono::nanoseconds pause) {
+            counts[bucketOf((uint64_t)pause.count())]++;
+            pauseCnt++;
+            totalPause += pause;
+            if (pause > maxPause)
+                maxPause = pause;
+        }
 
-            for (auto ptr : roots) {
-                if (ptr->meta && !ptr->isOld) {
-                    mark(ptr->meta);
-                }
+        std::chrono::nanoseconds PauseHistogram::percentile(double p) const {
+            if (!pauseCnt)
+                return std::chrono::nanoseconds(0);
+            auto rank = (size_t)(p * pauseCnt + 0.999999);
+            rank = std::clamp(rank, (size_t)1, pauseCnt);
+            size_t seen = 0;
+            for (size_t i = 0; i < BucketCount; i++) {
+                seen += counts[i];
+                if (seen >= rank)
+                    return std::min(std::chrono::nanoseconds((int64_t)upperBoundOf(i)), maxPause);
             }
+            return maxPause;
+        }
 
-            for (auto ptr : intergenerationalPtrs) {
-                if (ptr->meta)
-                    mark(ptr->meta);
+        Collector::Pause::Pause(Collector* col) : c(col) {
+            if (c->pauseDepth++ == 0)
+                c->pauseStart = std::chrono::steady_clock::now();
+        }
+
+        Collector::Pause::~Pause() {
+            if (--c->pauseDepth == 0) {
+                auto d = std::chrono::steady_clock::now() - c->pauseStart;
+                c->pausedTime += d;
+                c->pauses.record(d);
             }
+        }
 
-            sweep(newGen);
+        // Time spent in pauses, so incremental collections do not count the mutator in between.
+        std::chrono::nanoseconds Collector::activeTime() {
+            auto t = pausedTime;
+            if (pauseDepth)
+                t += std::chrono::steady_clock::now() - pauseStart;
+            return t;
         }
 
-        void Collector::sweep(MetaSet& gen) {
-            for (auto it = gen.begin(); it != gen.end();) {
-                auto* meta = *it;
+        bool Collector::startRecording(const char* path) {
+            WorldLock lk(this);
+            auto* f = fopen(path, "wb");
+            if (!f)
+                return false;
+            if (!recorder)
+                PtrBase::recordingHeaps++;
+            delete recorder;
+            recorder = new AllocTraceWriter(f);
+            return true;
+        }
 
-                if (meta->color == ObjMeta::Color::White) {
-                    freeObjCntOfPrevGc++;
-                    it = gen.erase(it);
-                    delete meta;
-                } else {
-                    if (!full && ++meta->scanCountInNewGen >= scanCountToOldGen) {
-                        meta->scanCountInNewGen = 0;
-                        it = newGen.erase(it);
-                        promote(meta);
-                    } else
-                        ++it;
-                }
+        bool Collector::stopRecording() {
+            WorldLock lk(this);
+            if (!recorder)
+                return true;
+            PtrBase::recordingHeaps--;
+            auto ok = recorder->close();
+            delete recorder;
+            recorder = nullptr;
+            return ok;
+        }
+
+        void Collector::setListener(GcListener* l) {
+            WorldLock lk(this);
+            // Called by a destructor while collecting, the running collection is not reported anymore.
+            if (eventDepth)
+                reporting = false;
+            delete listener;
+            listener = l;
+        }
+
+        // Collections started while one is reported (e.g. by destructors) are part of it.
+        void Collector::beginCollection(GcEvent::Kind kind) {
+            if (eventDepth++ || (!listener && !gcCond))
+                return;
+            reporting = true;
+            cycleEvent = GcEvent();
+            cycleEvent.kind = kind;
+            cycleEvent.marked = marked;
+            cycleEvent.freed = stats.lastFreed;
+            cycleEvent.promoted = stats.promoted;
+            cycleStart = activeTime();
+            setTotals(cycleEvent);
+            if (listener)
+                listener->onBegin(this, cycleEvent);
+        }
+
+        void Collector::endCollection() {
+            if (--eventDepth || !reporting)
+                return;
+            reporting = false;
+            finishEvent(cycleEvent, cycleStart);
+            setTotals(cycleEvent);
+            if (listener)
+                listener->onEnd(this, cycleEvent);
+            if (gcCond)
+                gcCond->onCollected(this, cycleEvent);
+        }
+
+        void Collector::beginPhase(GcEvent::Phase phase) {
+            if (eventDepth != 1 || !reporting || !listener)
+                return;
+            phaseEvent = GcEvent();
+            phaseEvent.kind = cycleEvent.kind;
+            phaseEvent.phase = phase;
+            phaseEvent.marked = marked;
+            phaseEvent.freed = stats.lastFreed;
+            phaseEvent.promoted = stats.promoted;
+            phaseStart = activeTime();
+            setTotals(phaseEvent);
+            listener->onBegin(this, phaseEvent);
+        }
+
+        void Collector::endPhase() {
+            if (eventDepth != 1 || !reporting || !listener)
+                return;
+            finishEvent(phaseEvent, phaseStart);
+            setTotals(phaseEvent);
+            listener->onEnd(this, phaseEvent);
+        }
+
+        // Turns the counters taken at the begin of the event into deltas.
+        void Collector::finishEvent(GcEvent& e, std::chrono::nanoseconds start) {
+            e.duration = activeTime() - start;
+            auto delta = [](HeapStats::Count now, const HeapStats::Count& then) {
+                now -= then;
+                return now;
+            };
+            e.marked = delta(marked, e.marked);
+            e.freed = delta(stats.lastFreed, e.freed);
+            e.promoted = delta(stats.promoted, e.promoted);
+        }
+
+        void Collector::setTotals(GcEvent& e) {
+            e.allocated = stats.allocated;
+            e.live = stats.live();
+            e.old = stats.old;
+        }
+
+        TraceRecorder::TraceRecorder(size_t capacity) : origin(std::chrono::steady_clock::now()), ring(capacity) {
+            assert(capacity);
+        }
+
+        int64_t TraceRecorder::now() const {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin)
+                .count();
+        }
+
+        void TraceRecorder::push(const Record& r) {
+            ring[pushed++ % ring.size()] = r;
+        }
+
+        void TraceRecorder::onBegin(Collector* c, const GcEvent& e) {
+            lock_guard<mutex> lk(mtx);
+            auto& r = e.phase == GcEvent::Phase::None ? cycle : phase;
+            r.type = Record::Type::Span;
+            r.begin = now();
+            r.tid = std::hash<thread::id>()(this_thread::get_id());
+            if (e.phase != GcEvent::Phase::None)
+                return;
+
+            Record counter;
+            counter.begin = r.begin;
+            if (lastAllocTime >= 0 && r.begin > lastAllocTime) {
+                counter.type = Record::Type::AllocRate;
+                // bytes per nanosecond to MB/s
+                counter.value = (e.allocated.bytes - lastAllocBytes) * 1e3 / (r.begin - lastAllocTime);
+                push(counter);
             }
+            lastAllocTime = r.begin;
+            lastAllocBytes = e.allocated.bytes;
+            counter.type = Record::Type::Live;
+            counter.value = (double)e.live.bytes;
+            push(counter);
+        }
 
-            if (trace)
-                printf("sweep %s, free cnt:%d\n", &gen == &oldGen ? "old" : "new", freeObjCntOfPrevGc);
+        void TraceRecorder::onEnd(Collector* c, const GcEvent& e) {
+            lock_guard<mutex> lk(mtx);
+            auto& r = e.phase == GcEvent::Phase::None ? cycle : phase;
+            r.event = e;
+            r.end = now();
+            push(r);
+            if (e.phase == GcEvent::Phase::None) {
+                Record counter;
+                counter.type = Record::Type::Live;
+                counter.begin = r.end;
+                counter.value = (double)e.live.bytes;
+                push(counter);
+            }
         }
 
-        void Collector::promote(ObjMeta* meta) {
-            oldGen.push_back(meta);
-            if (auto it = meta->klass->enumPtrs(meta)) {
-                for (; auto* p = it->getNext();) {
-                    p->isOld = true;
-                    if (p->meta)
-                        intergenerationalPtrs.insert(p);
+        void TraceRecorder::clear() {
+            lock_guard<mutex> lk(mtx);
+            pushed = 0;
+            lastAllocTime = -1;
+        }
+
+        std::string TraceRecorder::toJson() {
+            static const char* kindNames[] = {"minor collection", "full collection", "incremental collection"};
+            static const char* phaseNames[] = {"", "finalize", "roots", "mark", "sweep"};
+
+            lock_guard<mutex> lk(mtx);
+            std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                              "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"tgc2\"}}";
+            char buf[512];
+            auto first = pushed > ring.size() ? pushed - ring.size() : 0;
+            for (auto i = first; i < pushed; i++) {
+                auto& r = ring[i % ring.size()];
+                auto& e = r.event;
+                if (r.type == Record::Type::Span) {
+                    auto* name = e.phase == GcEvent::Phase::None ? kindNames[(int)e.kind] : phaseNames[(int)e.phase];
+                    snprintf(
+                        buf,
+                        sizeof(buf),
+                        ",\n{\"name\":\"%s\",\"cat\":\"gc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,"
+                        "\"tid\":%zu,\"args\":{\"pause_us\":%.3f,\"marked_objects\":%zu,\"marked_bytes\":%zu,"
+                        "\"freed_objects\":%zu,\"freed_bytes\":%zu,\"promoted_objects\":%zu,"
+                        "\"promoted_bytes\":%zu}}",
+                        name,
+                        r.begin / 1e3,
+                        (r.end - r.begin) / 1e3,
+                        r.tid % 1000000,
+                        e.duration.count() / 1e3,
+                        e.marked.objects,
+                        e.marked.bytes,
+                        e.freed.objects,
+                        e.freed.bytes,
+                        e.promoted.objects,
+                        e.promoted.bytes);
+                } else {
+                    auto allocRate = r.type == Record::Type::AllocRate;
+                    snprintf(
+                        buf,
+                        sizeof(buf),
+                        ",\n{\"name\":\"%s\",\"cat\":\"gc\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+                        "\"args\":{\"%s\":%.3f}}",
+                        allocRate ? "allocation rate" : "live bytes",
+                        r.begin / 1e3,
+                        allocRate ? "MB/s" : "bytes",
+                        r.value);
                 }
-                delete it;
+                out += buf;
             }
+            out += "\n]}\n";
+            return out;
         }
 
-        void Collector::fullCollect() {
-            freeObjCntOfPrevGc = 0;
-            full = true;
-            fullGcCount++;
+        bool TraceRecorder::save(const char* path) {
+            auto json = toJson();
+            auto* f = fopen(path, "wb");
+            if (!f)
+                return false;
+            auto ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+            return fclose(f) == 0 && ok;
+        }
 
-            for (auto meta : newGen)
-                preMark(meta);
-            for (auto meta : oldGen)
-                preMark(meta);
+        GcCondition_Adaptive::GcCondition_Adaptive(std::chrono::microseconds target, double growth)
+            : pauseTarget(target), heapGrowth(growth) {}
 
-            handleUnrefs();
-            handleDelayIntergenerationalPtrs();
+        bool GcCondition_Adaptive::needMinorGc(Collector* c) {
+            return c->getAllocatedSinceGc() >= nurseryBytes;
+        }
 
-            for (auto ptr : roots) {
-                if (ptr->meta) {
-                    mark(ptr->meta);
+        // Whether the survivors of the next minor collection would exceed the threshold.
+        bool GcCondition_Adaptive::needFullGc(Collector* c) {
+            return lastLive + (size_t)(survivalRate * nurseryBytes) > fullGcBytes;
+        }
+
+        void GcCondition_Adaptive::onCollected(Collector* c, const GcEvent& e) {
+            auto collected = e.allocated.bytes - lastAllocated;
+            lastAllocated = e.allocated.bytes;
+            lastLive = e.live.bytes;
+            if (e.kind != GcEvent::Kind::Minor) {
+                fullGcBytes = max(MinFullGcBytes, (size_t)(e.live.bytes * heapGrowth));
+                return;
+            }
+            // Pauses of tiny collections (e.g. explicit ones) are mostly the root scan.
+            if (collected < PageAllocator::PageSize)
+                return;
+            auto smooth = [](double& v, double x) { v = v ? (v + x) / 2 : x; };
+            smooth(survivalRate, min(1.0, (double)e.marked.bytes / collected));
+            smooth(nsPerByte, (double)e.duration.count() / collected);
+            if (nsPerByte <= 0)
+                return;
+            // The pause grows with the survivors, so about linearly with the nursery size
+            // for a given survival rate. Changes are bounded to keep the size stable.
+            auto target = std::chrono::nanoseconds(pauseTarget).count() / nsPerByte;
+            target = min(target, nurseryBytes * 2.0);
+            target = max(target, nurseryBytes / 2.0);
+            nurseryBytes = min(MaxNurseryBytes, max(MinNurseryBytes, (size_t)target));
+        }
+
+        // Not from the destructors run by the heap (e.g. while it collects or is destroyed).
+        bool Collector::allocationMayCollect() {
+            if (destroying)
+                return false;
+#ifdef TGC_MULTI_THREADED
+            return !isCollectorThread();
+#else
+            return !pauseDepth;
+#endif
+        }
+
+        void Collector::collectIfNeeded() {
+            // Incremental cycles are driven by `collectStep`, new objects survive them anyway.
+            if (!gcCond || phase != Phase::Idle || !allocationMayCollect() || !gcCond->needMinorGc(this))
+                return;
+            collect();
+        }
+
+        // Frees memory for an allocation of `size` bytes that failed, returns false once
+        // there is nothing left to try.
+        bool Collector::reclaim(int attempt, size_t size) {
+            if (!allocationMayCollect())
+                return false;
+            switch (attempt) {
+            case 0:
+                minorCollect();
+                releaseCachedPages();
+                return true;
+            case 1:
+                break;
+            case 2: {
+                auto& m = mutator();
+                std::function<void(size_t)> handler;
+                {
+                    WorldLock lk(this);
+                    handler = oomHandler;
                 }
+                if (!handler || m.inOomHandler)
+                    return false;
+                m.inOomHandler = true;
+                try {
+                    handler(size);
+                } catch (...) {
+                    m.inOomHandler = false;
+                    throw;
+                }
+                m.inOomHandler = false;
+                break;
+            }
+            default:
+                return false;
             }
+            // Dead blocks are only released once swept and finalized.
+            fullCollect();
+            finishSweep();
+            runFinalizers();
+            releaseCachedPages();
+            return true;
+        }
 
-            sweep(newGen);
-            sweep(oldGen);
-            full = false;
+        // The pages kept for reuse count against the heap limit as well.
+        void Collector::releaseCachedPages() {
+            nursery.releaseFreePages();
+#ifdef TGC_MULTI_THREADED
+            lock_guard<mutex> lk(heapMtx);
+#endif
+            pages.releaseEmptyPages();
+        }
+
+        void Collector::setHeapLimit(size_t bytes) {
+            WorldLock lk(this);
+            finishSweep();
+            pages.limit = bytes;
+        }
+
+        void Collector::setOutOfMemoryHandler(std::function<void(size_t size)> handler) {
+            WorldLock lk(this);
+            oomHandler = std::move(handler);
         }
 
         void Collector::collect() {
+            WorldLock lk(this);
+            finishCycle();
             if (gcCond && gcCond->needFullGc(this)) {
                 fullCollect();
             } else {
@@ -372,56 +2649,106 @@ namespace tgc2 {
         }
 
         void Collector::dumpStats() {
+            WorldLock lk(this);
+            auto s = getHeapStats();
+            auto live = s.live();
             printf("========= [gc] ========\n");
             printf("[newGen meta    ] %zu\n", newGen.size());
             printf("[oldGen meta    ] %zu\n", oldGen.size());
-            auto liveCnt = 0;
-            for (auto i : newGen)
-                if (i->arrayLength)
-                    liveCnt++;
-            for (auto i : oldGen)
-                if (i->arrayLength)
-                    liveCnt++;
-            printf("[live objects   ] %3d\n", liveCnt);
-            printf("[new gen gc cnt ] %3d\n", newGenGcCount);
-            printf("[full gc cnt    ] %3d\n", fullGcCount);
-            printf("[last freed objs] %3d\n", freeObjCntOfPrevGc);
+            printf("[nursery objects] %zu (%zu bytes)\n", s.nursery.objects, s.nursery.bytes);
+            printf("[young objects  ] %zu (%zu bytes)\n", s.young.objects, s.young.bytes);
+            printf("[old objects    ] %zu (%zu bytes)\n", s.old.objects, s.old.bytes);
+            printf("[live objects   ] %3zu (%zu bytes)\n", live.objects, live.bytes);
+            printf("[allocated objs ] %3zu (%zu bytes)\n", s.allocated.objects, s.allocated.bytes);
+            printf("[freed objs     ] %3zu (%zu bytes)\n", s.freed.objects, s.freed.bytes);
+            printf("[promoted objs  ] %3zu (%zu bytes)\n", s.promoted.objects, s.promoted.bytes);
+            printf("[new gen gc cnt ] %3zu\n", s.minorCollections);
+            printf("[full gc cnt    ] %3zu\n", s.fullCollections);
+            printf("[last freed objs] %3zu\n", s.lastFreed.objects);
+            printf("[small pages    ] %3zu\n", s.pages.smallPageCount);
+            printf("[large pages    ] %3zu\n", s.pages.largePageCount);
+            printf("[nursery pages  ] %3zu\n", s.pages.nurseryPageCount);
+            printf("[page occupancy ] %5.1f%%\n", s.pages.occupancy() * 100.0);
+            if (s.heapLimit)
+                printf("[heap headroom  ] %zu of %zu bytes\n", s.headroom(), s.heapLimit);
+            for (size_t i = 0; i < PageAllocator::SizeClassCount; i++) {
+                auto classStats = pages.getClassStats(i);
+                if (classStats.pageCount)
+                    printf(
+                        "  [%4zu bytes   ] pages: %zu, used slots: %zu\n",
+                        classStats.slotSize,
+                        classStats.pageCount,
+                        classStats.usedSlots);
+            }
             printf("=======================\n");
         }
 
         string Collector::getStats() {
+            auto s = getHeapStats();
             std::string sOutput = "========= [Garbage Collector] ========\n";
-
-            // Count how much alive objects right now.
-            size_t iAliveObjectsCount = 0;
-            for (auto i : newGen)
-                if (i->arrayLength)
-                    iAliveObjectsCount += 1;
-            for (auto i : oldGen)
-                if (i->arrayLength)
-                    iAliveObjectsCount += 1;
-
-            // Add to output.
-            sOutput += "[alive objects   ]: " + std::to_string(iAliveObjectsCount) + "\n";
-            sOutput += "[last freed count]: " + std::to_string(freeObjCntOfPrevGc);
+            sOutput += "[alive objects   ]: " + std::to_string(s.live().objects) + "\n";
+            sOutput += "[alive bytes     ]: " + std::to_string(s.live().bytes) + "\n";
+            sOutput += "[last freed count]: " + std::to_string(s.lastFreed.objects) + "\n";
+            sOutput += "[page occupancy  ]: " + std::to_string((int)(s.pages.occupancy() * 100.0)) + "%";
 
             return sOutput;
         }
 
-        size_t Collector::getAliveObjectsCount() {
-            size_t iAliveObjectsCount = 0;
+        HeapStats Collector::getHeapStats() {
+            WorldLock lk(this);
+            finishSweep();
+            auto s = stats;
+            s.pages = pages.getStats();
+            s.heapLimit = pages.limit;
+            return s;
+        }
 
-            for (auto i : newGen)
-                if (i->arrayLength)
-                    iAliveObjectsCount += 1;
-            for (auto i : oldGen)
-                if (i->arrayLength)
-                    iAliveObjectsCount += 1;
+        vector<ClassStats> Collector::getClassStats() {
+            WorldLock lk(this);
+            finishSweep();
+            vector<ClassStats> r;
+            for (auto& cs : classStats) {
+                if (cs.klass)
+                    r.push_back(cs);
+            }
+            sort(r.begin(), r.end(), [](const ClassStats& a, const ClassStats& b) {
+                return a.live.bytes > b.live.bytes;
+            });
+            return r;
+        }
 
-            return iAliveObjectsCount;
+        void Collector::dumpClassStats(size_t maxCnt) {
+            auto all = getClassStats();
+            printf("========= [gc classes] ========\n");
+            printf(
+                "%12s %10s %10s %10s %10s %10s  %s\n",
+                "live bytes",
+                "live objs",
+                "allocated",
+                "freed",
+                "promoted",
+                "survived",
+                "class");
+            for (size_t i = 0; i < all.size() && i < maxCnt; i++) {
+                auto& cs = all[i];
+                auto name = cs.klass->name();
+                printf(
+                    "%12zu %10zu %10zu %10zu %10zu %10zu  %.*s\n",
+                    cs.live.bytes,
+                    cs.live.objects,
+                    cs.allocated,
+                    cs.freed,
+                    cs.promoted,
+                    cs.survived,
+                    (int)name.size(),
+                    name.data());
+            }
+            printf("===============================\n");
         }
 
-        size_t Collector::getLastFreedObjectsCount() { return static_cast<size_t>(freeObjCntOfPrevGc); }
+        size_t Collector::getAliveObjectsCount() { return getHeapStats().live().objects; }
+
+        size_t Collector::getLastFreedObjectsCount() { return getHeapStats().lastFreed.objects; }
 
     } // namespace details
 } // namespace tgc2
@@ -27,9 +27,20 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #pragma once
 
+#include <atomic>
+#include <bitset>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <ctime>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <unordered_set>
 #include <vector>
 
@@ -51,8 +62,10 @@ namespace tgc2 {
         class ObjMeta;
         class ClassMeta;
         class PtrBase;
-        class IPtrEnumerator;
+        class PtrVisitor;
         class Collector;
+        class WorkerPool;
+        class BackgroundWorker;
 
         //////////////////////////////////////////////////////////////////////////
 
@@ -123,6 +136,20 @@ namespace tgc2 {
                     remove(o);
                     return n;
                 }
+                // Moves all elements of `other` to the end.
+                void append(list& other) {
+                    if (!other.m_first)
+                        return;
+                    if (m_last) {
+                        next(m_last) = other.m_first;
+                        prev(other.m_first) = m_last;
+                    } else {
+                        m_first = other.m_first;
+                    }
+                    m_last = other.m_last;
+                    m_size += other.m_size;
+                    other = list();
+                }
                 T* back() { return m_last; }
                 void pop_back() { remove(m_last); }
                 iterator begin() { return {m_first}; }
@@ -135,73 +162,326 @@ namespace tgc2 {
 
         class ObjMeta {
         public:
-            enum class Color : unsigned char { White, Black };
             static constexpr unsigned char Magic = 0xdd;
 
             ClassMeta* klass = nullptr;
             helper::list_slot<ObjMeta> gen;
             size_t arrayLength = 0;
-            Color color;
+            uint16_t markEpoch = 0; // marked if equal to `Collector::markEpoch`, which is never 0
             unsigned char magic = Magic;
             unsigned char scanCountInNewGen;
-            bool hasSubPtrs = true;
+            bool inNursery = false; // not linked to any generation list yet, see `Nursery`
+            bool isOld = false;
+            unsigned char heap; // index of the owning `Collector`
 
-            ObjMeta(ClassMeta* c, char* o, size_t n)
-                : klass(c), arrayLength(n), color(Color::Black), scanCountInNewGen(0) {}
+            ObjMeta(ClassMeta* c, char* o, size_t n, unsigned char h)
+                : klass(c), arrayLength(n), scanCountInNewGen(0), heap(h) {}
             ~ObjMeta() {
                 if (arrayLength)
-                    destroy();
+                    finalize();
             }
             void operator delete(void* c);
             bool containsPtr(char* p);
             char* objPtr() const { return (char*)this + sizeof(ObjMeta); }
+            // Bytes of the header and the elements.
+            size_t blockSize() const;
+            // Destroys the elements of a live object (see `gc_delete`).
             void destroy();
+            // Destroys the elements of a dead object, already counted as freed by the collection.
+            void finalize();
         };
 
         static_assert(sizeof(ObjMeta) <= sizeof(void*) * 5, "too large for small allocation");
 
         //////////////////////////////////////////////////////////////////////////
 
-        class IPtrEnumerator {
+        // Default backing memory for `ObjMeta` + object blocks (see `ClassMeta::callAlloc`).
+        // Small blocks are carved from fixed-size slabs ("pages") segregated by size class,
+        // each page keeping its own free list; larger blocks get a dedicated page.
+        // Every page is aligned to `PageSize` and starts with a `Page` header, so the page
+        // owning a block is found by masking the block address.
+        class PageAllocator {
         public:
-            virtual ~IPtrEnumerator() {}
-            virtual const PtrBase* getNext() = 0;
+            static constexpr size_t PageSize = 64 * 1024;
+            static constexpr size_t Granularity = 16;
+            static constexpr size_t MaxSmallSize = 8192;
+            static constexpr size_t SizeClassCount = 36;
+
+            struct Page {
+                enum class Kind : unsigned char { Small, Large, Nursery };
+
+                helper::list_slot<Page> link;
+                PageAllocator* owner = nullptr;
+                void* freeList = nullptr;
+                size_t slotSize = 0;
+                unsigned int capacity = 0;
+                unsigned int usedCount = 0; // for nursery pages: count of pinned survivors
+                unsigned int bumpIdx = 0; // for nursery pages: index while detached
+                unsigned char sizeClass = 0;
+                Kind kind = Kind::Small;
+
+                char* slots();
+            };
+
+            static constexpr size_t HeaderSize = (sizeof(Page) + Granularity - 1) / Granularity * Granularity;
 
-            static vector<char*> buf;
+            struct Stats {
+                size_t smallPageCount = 0;
+                size_t largePageCount = 0;
+                size_t nurseryPageCount = 0;
+                size_t usedSlots = 0;
+                size_t totalSlots = 0;
+                size_t usedBytes = 0;     // bytes handed out, rounded up to the slot size
+                size_t reservedBytes = 0; // bytes held from the system
+
+                // Ratio of used slots to all slots of the small pages.
+                double occupancy() const { return totalSlots ? (double)usedSlots / totalSlots : 0.0; }
+            };
+
+            struct ClassStats {
+                size_t slotSize = 0;
+                size_t pageCount = 0;
+                size_t usedSlots = 0;
+            };
 
-            void* operator new(size_t) {
-                if (buf.size()) {
-                    auto* ret = buf.back();
-                    buf.pop_back();
-                    return ret;
+            PageAllocator();
+            ~PageAllocator();
+            PageAllocator(const PageAllocator&) = delete;
+            PageAllocator& operator=(const PageAllocator&) = delete;
+
+            void* allocate(size_t size);
+            static void deallocate(void* p);
+            static Page* pageOf(const void* p) { return (Page*)((uintptr_t)p & ~(uintptr_t)(PageSize - 1)); }
+            // Whether the address is inside a page of any allocator, in O(1).
+            static bool contains(const void* p);
+
+            const Stats& getStats() const { return stats; }
+            ClassStats getClassStats(size_t sizeClass) const;
+            // Frees the empty pages kept for reuse by `release`.
+            void releaseEmptyPages();
+
+        private:
+            friend class Nursery;
+
+            using PageList = helper::list<Page, &Page::link>;
+
+            void* reservePage(size_t size);
+            Page* newPage(unsigned char sizeClass);
+            Page* newNurseryPage();
+            void* allocateLarge(size_t size);
+            void release(Page* page, void* p);
+            void freePage(Page* page);
+
+            // Locks the allocator while blocks are released from another thread.
+            struct Guard {
+                PageAllocator& a;
+                bool locked;
+                Guard(PageAllocator& pa) : a(pa), locked(pa.concurrent) {
+                    if (locked)
+                        a.mtx.lock();
                 }
-                return new char[255];
+                ~Guard() {
+                    if (locked)
+                        a.mtx.unlock();
+                }
+            };
+
+        public:
+            // Set by the owning thread while another thread may release blocks
+            // (see `Collector::setBackgroundSweep`), allocations are locked then.
+            bool concurrent = false;
+            // Reserving pages beyond `limit` bytes throws `std::bad_alloc`, 0 for no limit.
+            size_t limit = 0;
+
+        private:
+            mutex mtx;
+            PageList partialPages[SizeClassCount]; // pages having at least one free slot
+            size_t classPageCount[SizeClassCount] = {};
+            size_t classUsedSlots[SizeClassCount] = {};
+            Stats stats;
+        };
+
+        //////////////////////////////////////////////////////////////////////////
+
+        // Contiguous region for young objects: blocks are allocated by bumping a pointer
+        // inside nursery pages and are not linked to the `newGen` list. A collection pins
+        // the marked survivors into their page and rewinds every page without survivors
+        // at once, only objects with non-trivial destructors are visited when dying.
+        // The holes between pinned survivors refill the allocation buffers before new pages.
+        class Nursery {
+        public:
+            static constexpr size_t MaxObjectSize = PageAllocator::PageSize / 8;
+            static constexpr size_t FreePagesToKeep = 16;
+            // Survivors pin whole lines, holes are runs of free lines.
+            static constexpr size_t LineSize = 256;
+            static constexpr size_t LinesPerPage = PageAllocator::PageSize / LineSize;
+
+            // Bump region of a mutator, refilled with a hole or a whole page when exhausted.
+            struct AllocationBuffer {
+                char* cursor = nullptr;
+                char* limit = nullptr;
+            };
+
+            // Space handed out since the last collection.
+            struct Detached {
+                vector<PageAllocator::Page*> pages; // the ones pinned by the nursery come last
+                size_t pinnedFrom = 0;
+                vector<std::bitset<LinesPerPage>> freeLines; // per page, cleared by `pin`
+            };
+
+            Nursery(PageAllocator& p) : pages(p) {}
+            ~Nursery();
+            Nursery(const Nursery&) = delete;
+            Nursery& operator=(const Nursery&) = delete;
+
+            void* allocate(AllocationBuffer& buffer, size_t size) {
+                size = (size + PageAllocator::Granularity - 1) & ~(PageAllocator::Granularity - 1);
+                auto* p = buffer.cursor;
+                if (size > (size_t)(buffer.limit - p))
+                    return refill(buffer, size);
+                buffer.cursor = p + size;
+                return p;
             }
-            void operator delete(void* p) { buf.push_back((char*)p); }
+
+            // Bytes of the pages filled since the last collection, read without locking.
+            size_t usedBytes() const { return used.load(std::memory_order_relaxed); }
+
+            // Detaches the pages filled and the holes left since the last collection, the
+            // allocation buffers pointing into them have to be reset so that new allocations
+            // (e.g. from destructors) go to other pages.
+            Detached detachPages();
+            // Pins a surviving block into its detached page.
+            static void pin(Detached& detached, const void* block, size_t size);
+            // Rewinds the detached pages without pinned survivors, the holes of the other
+            // ones refill the allocation buffers until the next collection. A page without
+            // holes is freed by the allocator once all of its survivors are gone.
+            void recyclePages(Detached& detached);
+            // Frees the pages kept for refilling.
+            void releaseFreePages();
+
+        private:
+            // Free range of a nursery page.
+            struct Hole {
+                char* begin;
+                char* end;
+            };
+
+            void* refill(AllocationBuffer& buffer, size_t size);
+            void recyclePage(PageAllocator::Page* page);
+
+            PageAllocator& pages;
+#ifdef TGC_MULTI_THREADED
+            mutex mtx; // guards the page lists, refilled pages and holes are zeroed
+#endif
+            vector<PageAllocator::Page*> usedPages;
+            vector<PageAllocator::Page*> freePages;
+            // Grouped by page, every page having holes is pinned once more by the nursery.
+            vector<Hole> holes;
+            size_t nextHole = 0;
+            std::atomic<size_t> used{0};
         };
 
-        class ObjPtrEnumerator : public IPtrEnumerator {
-            size_t subPtrIdx = 0, arrayElemIdx = 0;
-            ClassMeta* klass;
-            char* base;
-            size_t len;
+        //////////////////////////////////////////////////////////////////////////
 
+        // Receives the sub pointers reported by the trace functions of `PtrEnumerator`
+        // specializations. Pointers are buffered and handed over to the collector in batches,
+        // so tracing needs neither a heap allocation nor a virtual call per pointer.
+        class PtrVisitor {
         public:
-            ObjPtrEnumerator(ClassMeta* c, char* o, size_t l) : klass(c), base(o), len(l) {}
-            PtrBase* getNext() override;
+            static constexpr size_t BatchSize = 64;
+            using Flush = void (*)(void* ctx, const PtrBase* const* ptrs, size_t cnt);
+
+            size_t visitedCount = 0;
+
+            PtrVisitor(Flush f, void* c) : flushFn(f), ctx(c) {}
+
+            void visit(const PtrBase* p) {
+                batch[batchSize++] = p;
+                if (batchSize == BatchSize)
+                    flush();
+            }
+            void flush() {
+                if (batchSize) {
+                    visitedCount += batchSize;
+                    flushFn(ctx, batch, batchSize);
+                    batchSize = 0;
+                }
+            }
+
+        private:
+            Flush flushFn;
+            void* ctx;
+            const PtrBase* batch[BatchSize];
+            size_t batchSize = 0;
         };
 
-        template <typename T> struct PtrEnumerator : ObjPtrEnumerator {
-            using ObjPtrEnumerator::ObjPtrEnumerator;
+        struct ContainerPtrEnumerator;
+
+        // Traces objects using the sub pointer offsets recorded in their class meta.
+        struct ObjPtrEnumerator {
+            static void trace(ClassMeta* klass, char* obj, size_t len, PtrVisitor& v);
         };
 
+        // Declares the gc pointer members of a class inside its body, e.g.
+        //   struct Node { gc<Node> left, right; TGC_FIELDS(Node, &Node::left, &Node::right); };
+        // Such classes are traced through the listed member pointers instead of offsets
+        // discovered while constructing the first instance. Unlisted gc members are roots.
+#define TGC_FIELDS(T, ...)                                                                                   \
+    using tgcFieldsOwner = T;                                                                                \
+    static constexpr auto tgcFields() { return std::make_tuple(__VA_ARGS__); }
+
+        // Not inherited: a derived class without its own declaration falls back to runtime discovery.
+        template <typename T, typename = void> struct HasGcFields : false_type {};
+        template <typename T>
+        struct HasGcFields<T, void_t<decltype(T::tgcFields())>>
+            : bool_constant<is_same_v<typename T::tgcFieldsOwner, T>> {};
+
+        template <typename T> constexpr bool hasGcFields = HasGcFields<T>::value;
+
+        template <typename T> struct FieldPtrEnumerator : ObjPtrEnumerator {
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                constexpr auto fields = T::tgcFields();
+                auto* o = (T*)obj;
+                for (size_t i = 0; i < len; i++, o++) {
+                    apply([&](auto... field) { (visitField(o->*field, v), ...); }, fields);
+                }
+            }
+
+        private:
+            template <typename P> static void visitField(const P& p, PtrVisitor& v) {
+                static_assert(is_base_of_v<PtrBase, P>, "only gc pointers can be declared as fields");
+                v.visit(&p);
+            }
+        };
+
+        // Specialize and provide a static `trace` function to support custom containers.
+        template <typename T, typename = void> struct PtrEnumerator : ObjPtrEnumerator {};
+
+        template <typename T> struct PtrEnumerator<T, enable_if_t<hasGcFields<T>>> : FieldPtrEnumerator<T> {};
+
         //////////////////////////////////////////////////////////////////////////
 
+        // Name of the type as spelled by the compiler.
+        template <typename T> string_view typeName() {
+#if defined(_MSC_VER) && !defined(__clang__)
+            string_view s = __FUNCSIG__;
+            auto begin = s.find("typeName<") + 9;
+            auto end = s.rfind(">(void)");
+#else
+            string_view s = __PRETTY_FUNCTION__;
+            auto begin = s.find("T = ") + 4;
+            auto end = s.find(';', begin);
+            if (end == string_view::npos)
+                end = s.rfind(']');
+#endif
+            return s.substr(begin, end - begin);
+        }
+
         class ClassMeta {
         public:
-            enum class MemRequest { Dctor, NewPtrEnumerator };
+            enum class MemRequest { Dctor, TracePtrs, RegisterElems };
 
-            using MemHandler = void* (*)(ClassMeta* cls, MemRequest r, void* obj, size_t len);
+            using MemHandler = void (*)(ClassMeta* cls, MemRequest r, void* obj, size_t len, PtrVisitor* v);
             using OffsetType = unsigned short;
             using Alloc = void* (*)(size_t size);
             using Dealloc = void (*)(void* ptr);
@@ -209,39 +489,52 @@ namespace tgc2 {
             MemHandler memHandler = nullptr;
             vector<OffsetType>* subPtrOffsets = nullptr;
             unsigned short size = 0;
-            bool registered = false;
+            unsigned short id = 0; // index of the class in the class statistics of the heaps
+            atomic<bool> registered{false};
+            bool trivialDctor = false;
+            bool isContainer = false; // sub pointers may live outside of the object (e.g. in STL nodes)
+            bool declared = false;    // sub pointers are listed by `TGC_FIELDS`
 
-            static int isCreatingObj;
             static Alloc alloc;
             static Dealloc dealloc;
 
-            ClassMeta(MemHandler h, unsigned short sz) : memHandler(h), size(sz) {}
+            ClassMeta(
+                MemHandler h,
+                unsigned short sz,
+                bool trivialDctor,
+                bool isContainer,
+                bool declared,
+                string_view name)
+                : memHandler(h), size(sz), id(registerClass(name)), registered(declared),
+                  trivialDctor(trivialDctor), isContainer(isContainer), declared(declared) {}
             ~ClassMeta() { delete subPtrOffsets; }
             ObjMeta* newMeta(size_t objCnt);
             void registerSubPtr(ObjMeta* owner, PtrBase* p);
+            // Whether objects of the class may hold pointers, they are traced while constructed.
+            bool mayHavePtrs() const { return !registered || subPtrOffsets || declared || isContainer; }
             void endNewMeta(ObjMeta* meta, bool failed);
+            string_view name() const;
 
-            IPtrEnumerator* enumPtrs(void* obj, size_t cnt) {
-                return (IPtrEnumerator*)memHandler(this, MemRequest::NewPtrEnumerator, obj, cnt);
+            void tracePtrs(void* obj, size_t cnt, PtrVisitor& v) {
+                memHandler(this, MemRequest::TracePtrs, obj, cnt, &v);
             }
 
-            IPtrEnumerator* enumPtrs(ObjMeta* m) {
-                if (!m->hasSubPtrs)
-                    return nullptr;
-                return (IPtrEnumerator*)memHandler(
-                    this, MemRequest::NewPtrEnumerator, m->objPtr(), m->arrayLength);
-            }
+            void tracePtrs(ObjMeta* m, PtrVisitor& v) { tracePtrs(m->objPtr(), m->arrayLength, v); }
 
-            static char* callAlloc(size_t sz) { return alloc ? (char*)alloc(sz) : new char[sz]; }
-            static void callDealloc(void* p) { dealloc ? dealloc(p) : delete[] (char*)(p); }
+            // `alloc`/`dealloc` override the built-in `PageAllocator` of the collector,
+            // they should be set before the first gc object is created.
+            static char* callAlloc(PageAllocator& pages, size_t sz);
+            static void callDealloc(void* p);
 
             template <typename T> static ClassMeta* get() { return &Holder<T>::inst; }
 
             template <typename T> static ClassMeta* getRegistered();
 
         private:
+            static unsigned short registerClass(string_view name);
+
             template <typename T> struct Holder {
-                static void* MemHandler(ClassMeta* klass, MemRequest r, void* obj, size_t cnt) {
+                static void MemHandler(ClassMeta* klass, MemRequest r, void* obj, size_t cnt, PtrVisitor* v) {
                     switch (r) {
                     case MemRequest::Dctor: {
                         auto p = (T*)obj;
@@ -249,18 +542,28 @@ namespace tgc2 {
                             p->~T();
                         }
                     } break;
-                    case MemRequest::NewPtrEnumerator: {
-                        return new PtrEnumerator<T>(klass, (char*)obj, cnt);
+                    case MemRequest::TracePtrs: {
+                        PtrEnumerator<T>::trace(klass, (char*)obj, cnt, *v);
+                    } break;
+                    case MemRequest::RegisterElems: {
+                        if constexpr (is_base_of_v<ContainerPtrEnumerator, PtrEnumerator<T>>)
+                            PtrEnumerator<T>::registerElems();
                     } break;
                     }
-                    return nullptr;
                 }
 
                 static ClassMeta inst;
             };
         };
 
-        template <typename T> ClassMeta ClassMeta::Holder<T>::inst{MemHandler, sizeof(T)};
+        template <typename T>
+        ClassMeta ClassMeta::Holder<T>::inst{
+            MemHandler,
+            sizeof(T),
+            is_trivially_destructible_v<T>,
+            !is_base_of_v<ObjPtrEnumerator, PtrEnumerator<T>>,
+            hasGcFields<T>,
+            typeName<T>()};
 
         static_assert(sizeof(ClassMeta) <= sizeof(void*) * 3, "too large for small objects");
 
@@ -269,6 +572,8 @@ namespace tgc2 {
         class PtrBase {
             friend class Collector;
             friend class ClassMeta;
+            friend class SlotTable;
+            friend class PendingLog;
 
         public:
             ObjMeta* getMeta() { return meta; }
@@ -277,13 +582,143 @@ namespace tgc2 {
             PtrBase();
             PtrBase(void* obj);
             ~PtrBase();
+
             void writeBarrier();
+            void writeBarrierSlow();
+            void shadeSlow();
+            void recordStore();
+            void recordStoreSlow();
+
+            // Number of heaps marking incrementally, see `Collector::collectStep`.
+            static atomic<int> incrementalMarking;
+            // Number of heaps recording an allocation trace, see `Collector::startRecording`.
+            static atomic<int> recordingHeaps;
 
         protected:
             ObjMeta* meta = nullptr;
-            mutable bool isOld;
+            mutable unsigned int slot; // index in the roots (if `isRoot`) or remembered `SlotTable`
+            mutable bool isOld;        // lives in an old object
             mutable bool isRoot;
+            unsigned char heap; // index of the `Collector` it was created in
+        };
+
+        // Dense array of pointers where every pointer knows its own index,
+        // so adding and removing are O(1) and enumeration is a linear scan.
+        class SlotTable {
+        public:
+            static constexpr unsigned int NoSlot = ~0u;
+
+            void add(const PtrBase* p) {
+                p->slot = (unsigned int)ptrs.size();
+                ptrs.push_back(p);
+            }
+            void remove(const PtrBase* p) {
+                auto* last = ptrs.back();
+                last->slot = p->slot;
+                ptrs[p->slot] = last;
+                ptrs.pop_back();
+                p->slot = NoSlot;
+            }
+#ifdef TGC_MULTI_THREADED
+            // Removes without touching other entries, so mutators can remove concurrently
+            // (the table is never resized meanwhile). Cleared entries are dropped by `compact`.
+            void clear(const PtrBase* p) {
+                ptrs[p->slot] = nullptr;
+                p->slot = NoSlot;
+            }
+            void compact() {
+                size_t n = 0;
+                for (auto* p : ptrs) {
+                    if (p) {
+                        p->slot = (unsigned int)n;
+                        ptrs[n++] = p;
+                    }
+                }
+                ptrs.resize(n);
+            }
+#endif
+            void reserve(size_t n) { ptrs.reserve(n); }
+            size_t size() const { return ptrs.size(); }
+            const PtrBase* operator[](size_t i) const { return ptrs[i]; }
+            vector<const PtrBase*>::const_iterator begin() const { return ptrs.begin(); }
+            vector<const PtrBase*>::const_iterator end() const { return ptrs.end(); }
+
+        private:
+            vector<const PtrBase*> ptrs;
+        };
+
+#ifdef TGC_MULTI_THREADED
+        // Pointers added to a `SlotTable` by a mutator since the last safepoint, moved to the
+        // table while the world is stopped. Entries never move, so any thread can remove a
+        // pointer by clearing its entry.
+        class PendingLog {
+        public:
+            static constexpr unsigned int ChunkSize = 4096;
+            static constexpr unsigned int MaxChunks = 256;
+            static constexpr unsigned int MutatorShift = 20;      // pending slots also keep their mutator
+            static constexpr unsigned int PendingBit = 1u << 31; // marks pending `PtrBase::slot`s
+
+            static_assert(ChunkSize * MaxChunks == 1u << MutatorShift, "entry index overlaps the mutator");
+
+            PendingLog() = default;
+            PendingLog(const PendingLog&) = delete;
+            PendingLog& operator=(const PendingLog&) = delete;
+            ~PendingLog() {
+                for (auto* c : chunks)
+                    delete[] c;
+            }
+
+            static bool isPending(const PtrBase* p) {
+                return p->slot != SlotTable::NoSlot && (p->slot & PendingBit);
+            }
+            static unsigned int mutatorOf(const PtrBase* p) { return (p->slot & ~PendingBit) >> MutatorShift; }
+            // Returns false when full.
+            bool add(const PtrBase* p, unsigned int mutatorIdx) {
+                auto chunk = count / ChunkSize;
+                if (chunk == MaxChunks)
+                    return false;
+                if (!chunks[chunk])
+                    chunks[chunk] = new const PtrBase*[ChunkSize];
+                p->slot = PendingBit | mutatorIdx << MutatorShift | count;
+                chunks[chunk][count % ChunkSize] = p;
+                count++;
+                return true;
+            }
+            void clear(const PtrBase* p) {
+                auto idx = p->slot & ((1u << MutatorShift) - 1);
+                chunks[idx / ChunkSize][idx % ChunkSize] = nullptr;
+                p->slot = SlotTable::NoSlot;
+            }
+            void moveTo(SlotTable& table) {
+                for (unsigned int i = 0; i < count; i++) {
+                    if (auto* p = chunks[i / ChunkSize][i % ChunkSize])
+                        table.add(p);
+                }
+                count = 0;
+            }
+
+        private:
+            const PtrBase** chunks[MaxChunks] = {};
+            unsigned int count = 0;
         };
+#endif
+
+        // Only a store into an old pointer can create an old-to-young edge: roots are
+        // registered on construction and young pointers are traced from their owner.
+        // While incremental marking, a stored unmarked object is shaded (incremental update),
+        // so an already scanned object never hides it. Roots are rescanned instead.
+        inline void PtrBase::writeBarrier() {
+            if (isOld && meta && !meta->isOld && slot == SlotTable::NoSlot)
+                writeBarrierSlow();
+            if (incrementalMarking.load(memory_order_relaxed) && meta && !isRoot)
+                shadeSlow();
+            recordStore();
+        }
+
+        inline void PtrBase::recordStore() {
+            if (recordingHeaps.load(memory_order_relaxed))
+                recordStoreSlow();
+        }
 
         template <typename T> class GcPtr : public PtrBase {
         public:
@@ -302,7 +737,7 @@ namespace tgc2 {
                 static_assert(is_base_of_v<T, U>, "invalid pointer cast");
                 reset(r.meta);
             }
-            GcPtr(const GcPtr& r) { reset(r.meta); }
+            GcPtr(const GcPtr& r) : PtrBase() { reset(r.meta); }
             GcPtr(GcPtr&& r) {
                 reset(r.meta);
                 r = nullptr;
@@ -332,6 +767,7 @@ namespace tgc2 {
             GcPtr& operator=(T* ptr) = delete;
             GcPtr& operator=(nullptr_t) {
                 meta = 0;
+                recordStore();
                 return *this;
             }
             bool operator<(const GcPtr& r) const { return *ptr() < *r.ptr(); }
@@ -374,13 +810,247 @@ namespace tgc2 {
 
         //////////////////////////////////////////////////////////////////////////
 
+        // Counters of a heap updated on every allocation, collection and `gc_delete`, so reading
+        // them is O(1). Bytes include the `ObjMeta` headers.
+        struct HeapStats {
+            struct Count {
+                size_t objects = 0;
+                size_t bytes = 0;
+
+                void add(size_t n) {
+                    objects++;
+                    bytes += n;
+                }
+                void sub(size_t n) {
+                    objects--;
+                    bytes -= n;
+                }
+                Count& operator+=(const Count& c) {
+                    objects += c.objects;
+                    bytes += c.bytes;
+                    return *this;
+                }
+                Count& operator-=(const Count& c) {
+                    objects -= c.objects;
+                    bytes -= c.bytes;
+                    return *this;
+                }
+            };
+
+            // Objects constructed and not destroyed yet, per generation.
+            Count nursery, young, old;
+            // Totals since the heap was created. An object is freed once, when `gc_delete`
+            // destroys it or when a collection finds it dead.
+            Count allocated, freed, promoted;
+            Count lastFreed; // by the last collection
+            size_t minorCollections = 0;
+            size_t fullCollections = 0;
+            PageAllocator::Stats pages;
+            size_t heapLimit = 0; // see `Collector::setHeapLimit`
+
+            Count live() const {
+                auto c = nursery;
+                c += young;
+                c += old;
+                return c;
+            }
+            // Bytes the pages of the heap may still grow by, `SIZE_MAX` without a limit.
+            size_t headroom() const {
+                if (!heapLimit)
+                    return SIZE_MAX;
+                return heapLimit > pages.reservedBytes ? heapLimit - pages.reservedBytes : 0;
+            }
+        };
+
+        // Counters of the objects of one class in a heap, see `Collector::getClassStats`.
+        struct ClassStats {
+            ClassMeta* klass = nullptr;
+            size_t allocated = 0;
+            size_t freed = 0;
+            size_t promoted = 0;
+            size_t survived = 0; // times an object was found alive by a sweep
+            HeapStats::Count live;
+            HeapStats::Count nursery; // part of `live` not swept yet
+
+            ClassStats& operator+=(const ClassStats& s) {
+                allocated += s.allocated;
+                freed += s.freed;
+                promoted += s.promoted;
+                survived += s.survived;
+                live += s.live;
+                nursery += s.nursery;
+                return *this;
+            }
+        };
+
+        // State of a thread allocating gc objects, the single threaded collector has only one.
+        struct Mutator {
+            Nursery::AllocationBuffer tlab;
+            vector<ObjMeta*> creatingObjs;     // objects under construction whose class learns its layout
+            vector<ObjMeta*> creatingDeclared; // nested `TGC_FIELDS` objects under construction
+            int isCreatingObj = 0;
+            bool inOomHandler = false; // see `Collector::setOutOfMemoryHandler`
+
+#ifdef TGC_MULTI_THREADED
+            // `Safe` threads do not touch gc pointers (e.g. waiting for a lock) and are not waited for.
+            enum class State : unsigned char { Running, Safe };
+
+            atomic<State> state{State::Running};
+            unsigned short index = 0;
+            ObjMeta* lastAllocated = nullptr; // may be referenced only by a raw `ObjMeta*` yet
+            PendingLog pendingRoots, pendingRemembered;
+            // Moved to the collector at safepoints.
+            vector<ObjMeta*> nurseryFinalizable;
+            vector<ObjMeta*> grey;
+            vector<ObjMeta*> nurserySurvivors;
+            HeapStats stats; // changes of the object counters (wrapping around when negative)
+            vector<ClassStats> classStats;
+#endif
+        };
+
+        // A collection or one of its phases, see `GcListener`.
+        struct GcEvent {
+            enum class Kind : unsigned char { Minor, Full, Incremental };
+            // Promotions happen while sweeping. Collections unmark all objects at once by
+            // advancing the mark epoch, so there is no phase before the root scan.
+            enum class Phase : unsigned char { None, Finalize, Roots, Mark, Sweep };
+
+            Kind kind = Kind::Minor;
+            Phase phase = Phase::None; // `None` for the whole collection
+            // Set by the end events, incremental collections only count the time of their steps.
+            std::chrono::nanoseconds duration{0};
+            HeapStats::Count marked;   // found alive by the collector
+            HeapStats::Count freed;    // not including the objects swept in the background
+            HeapStats::Count promoted;
+            // Totals of the heap when the event is reported.
+            HeapStats::Count allocated;
+            HeapStats::Count live;
+            HeapStats::Count old; // of the old generation
+        };
+
+        // Receives the collections of a heap and their phases, called on the collecting thread
+        // while the world is stopped, so the callbacks must not use gc pointers.
+        struct GcListener {
+            virtual ~GcListener() {}
+            virtual void onBegin(Collector* c, const GcEvent& e) {}
+            virtual void onEnd(Collector* c, const GcEvent& e) {}
+        };
+
+        // Pause times counted in log-linear buckets (8 per power of two nanoseconds),
+        // so percentiles are accurate to about 12%.
+        class PauseHistogram {
+        public:
+            void record(std::chrono::nanoseconds pause);
+            // Upper bound of the shortest `p` (0..1) fraction of the pauses, e.g. 0.99 for p99.
+            std::chrono::nanoseconds percentile(double p) const;
+            std::chrono::nanoseconds max() const { return maxPause; }
+            std::chrono::nanoseconds total() const { return totalPause; }
+            size_t count() const { return pauseCnt; }
+
+        private:
+            static constexpr int SubBucketBits = 3;
+            static constexpr size_t BucketCount = (64 - SubBucketBits + 1) << SubBucketBits;
+
+            static size_t bucketOf(uint64_t ns);
+            static uint64_t upperBoundOf(size_t bucket);
+
+            size_t counts[BucketCount] = {};
+            size_t pauseCnt = 0;
+            std::chrono::nanoseconds maxPause{0};
+            std::chrono::nanoseconds totalPause{0};
+        };
+
+        // Records the collections and their phases as spans, and the allocation rate and the live
+        // bytes as counters, keeping the latest `capacity` events in a ring buffer. `save` writes
+        // them in the Chrome trace event format, opened by https://ui.perfetto.dev.
+        class TraceRecorder : public GcListener {
+        public:
+            explicit TraceRecorder(size_t capacity = 16 * 1024);
+            void onBegin(Collector* c, const GcEvent& e) override;
+            void onEnd(Collector* c, const GcEvent& e) override;
+            std::string toJson();
+            bool save(const char* path);
+            void clear();
+
+        private:
+            struct Record {
+                enum class Type : unsigned char { Span, AllocRate, Live };
+                Type type = Type::Span;
+                GcEvent event;
+                int64_t begin = 0, end = 0; // nanoseconds since the recorder was created
+                size_t tid = 0;
+                double value = 0; // of the counters
+            };
+
+            int64_t now() const;
+            void push(const Record& r);
+
+            std::chrono::steady_clock::time_point origin;
+            mutex mtx;
+            vector<Record> ring;
+            size_t pushed = 0;
+            Record cycle, phase; // running
+            int64_t lastAllocTime = -1;
+            size_t lastAllocBytes = 0;
+        };
+
+        // Event of an allocation trace, see `Collector::startRecording`. Objects (their `ObjMeta`)
+        // and pointers are identified by their addresses in the recording process.
+        struct AllocTraceEvent {
+            enum class Type : unsigned char { Class = 1, Alloc, Constructed, NewPtr, Store, DeletePtr, Collect };
+            enum class CollectKind : unsigned char { Minor, Full, Step };
+
+            Type type = Type::Class;
+            // Alloc, Constructed: the object. NewPtr: the owner, 0 for roots. Store: the stored
+            // object, 0 for null.
+            uint64_t obj = 0;
+            uint64_t ptr = 0;         // NewPtr, Store, DeletePtr
+            uint64_t offset = 0;      // NewPtr: of the pointer in its owner
+            unsigned short klass = 0; // Class, Alloc: `ClassMeta::id`
+            size_t size = 0;          // Alloc: of the elements
+            size_t length = 0;        // Alloc: of the array
+            CollectKind collect = CollectKind::Minor;
+            std::chrono::microseconds budget{0}; // Collect: of a step
+            std::string name;                    // Class
+        };
+
+        class AllocTraceWriter;
+
+        // Reads a trace written by `Collector::startRecording`.
+        class AllocTraceReader {
+        public:
+            AllocTraceReader() {}
+            AllocTraceReader(const AllocTraceReader&) = delete;
+            AllocTraceReader& operator=(const AllocTraceReader&) = delete;
+            ~AllocTraceReader();
+            // Returns false if the file can not be read or is not a trace.
+            bool open(const char* path);
+            // Returns false at the end of the trace.
+            bool next(AllocTraceEvent& e);
+
+        private:
+            int byte();
+            uint64_t varint();
+            uint64_t address(uint64_t& last);
+
+            FILE* file = nullptr;
+            unsigned char buf[64 * 1024];
+            size_t pos = 0, end = 0;
+            uint64_t lastObj = 0, lastPtr = 0;
+        };
+
+        // Collection policy of a heap: every allocation asks `needMinorGc` (from any of its threads)
+        // and runs `collect` if true, which asks `needFullGc` for the kind of collection.
         struct GcCondition {
             virtual ~GcCondition() {}
             virtual bool needMinorGc(Collector* c) = 0;
             virtual bool needFullGc(Collector* c) = 0;
+            // Called at the end of every collection while the world is stopped.
+            virtual void onCollected(Collector* c, const GcEvent& e) {}
         };
 
         class Collector {
+            friend class ObjMeta;
             friend class ClassMeta;
             friend class PtrBase;
 
@@ -388,57 +1058,327 @@ namespace tgc2 {
             using MetaSet = helper::list<ObjMeta, &ObjMeta::gen>;
 
             MetaSet newGen, oldGen;
-            vector<ObjMeta*> creatingObjs;
+            // Containers by generation, their elements are adopted before the roots are scanned
+            // (see `adoptElems`).
+            unordered_set<ObjMeta*> youngContainers, oldContainers;
+            PageAllocator pages;
+            Nursery nursery{pages};
+            vector<ObjMeta*> nurseryFinalizable; // nursery objects with non-trivial destructors
+            vector<ObjMeta*> nurserySurvivors;   // nursery objects marked by the current collection
             vector<ObjMeta*> temp;
-            vector<PtrBase*> unrefs;
-            unordered_set<const PtrBase*> roots;
-            unordered_set<const PtrBase*> intergenerationalPtrs;
-            unordered_set<const PtrBase*> delayIntergenerationalPtrs;
+            SlotTable roots;
+            // Remembered set: old pointers stored since they were last known not to point
+            // into the young generation (i.e. "dirty" slots), rescanned by minor collections.
+            SlotTable remembered;
             GcCondition* gcCond = nullptr;
-
-            int freeObjCntOfPrevGc = 0;
-            int fullGcCount = 0;
-            int newGenGcCount = 0;
+            WorkerPool* markWorkers = nullptr; // parallel marking of full collections if set
+
+            // Background sweeping of full collections, see `setBackgroundSweep`.
+            bool backgroundSweep = false;
+            BackgroundWorker* sweeper = nullptr; // started by the first background sweep
+            bool sweeping = false;
+            MetaSet sweepingNewGen, sweepingOldGen; // detached from the mutator while swept
+            HeapStats swept; // dead young and old objects found by the sweeper
+            vector<ClassStats> sweptClasses;
+            mutex finalizeMtx;
+            vector<ObjMeta*> sweptFinalizable; // shared with the sweeper, guarded by `finalizeMtx`
+            vector<ObjMeta*> finalizeQueue;    // dead objects waiting for their destructor
+
+            HeapStats stats;              // see `getHeapStats`
+            vector<ClassStats> classStats; // indexed by `ClassMeta::id`
+            HeapStats::Count marked;       // by the collector, see `GcEvent::marked`
+            std::atomic<size_t> allocatedOutOfNursery{0}; // see `getAllocatedSinceGc`
             int scanCountToOldGen = 2;
             bool trace = false;
             bool full = false;
 
-            static Collector* inst;
+            // State of the incremental full collection driven by `collectStep`.
+            enum class Phase : unsigned char { Idle, Mark, Sweep };
+            Phase phase = Phase::Idle;
+            bool cursorInOld = false;
+            ObjMeta* cursor = nullptr; // next object to sweep
+            vector<ObjMeta*> grey;     // marked objects whose children are not scanned yet
+
+            // Pauses are the collections run while the world is locked, `collectStep` included.
+            GcListener* listener = nullptr;
+            PauseHistogram pauses;
+            std::chrono::nanoseconds pausedTime{0};
+            std::chrono::steady_clock::time_point pauseStart;
+            int pauseDepth = 0;
+            GcEvent cycleEvent, phaseEvent; // in progress, counting from their begin
+            std::chrono::nanoseconds cycleStart{0}, phaseStart{0};
+            int eventDepth = 0;     // nested collections, see `beginCollection`
+            bool reporting = false; // the running collection is reported to `listener` and `gcCond`
+            AllocTraceWriter* recorder = nullptr; // see `startRecording`
+            std::function<void(size_t)> oomHandler; // see `setOutOfMemoryHandler`
+            bool destroying = false;                // allocations of the destructors do not collect
+
+            // Objects are marked if their `ObjMeta::markEpoch` equals it, so a collection unmarks
+            // every object at once by advancing it. Minor collections treat old objects as marked.
+            uint16_t markEpoch = 1;
+
+#ifdef TGC_MULTI_THREADED
+            static constexpr size_t MaxMutators = 1024;
+            static_assert(MaxMutators <= PendingLog::PendingBit >> PendingLog::MutatorShift, "too many mutators");
+
+            // Every collector operation stops the world: mutators wait at their next safepoint.
+            // Registered mutators never move, so pending entries can be cleared by any thread.
+            Mutator* mutators[MaxMutators] = {};
+            size_t mutatorCnt = 0;
+            vector<Mutator*> exitedMutators; // reused by new threads
+            mutex worldMtx;
+            atomic<thread::id> worldOwner;
+            int worldLockDepth = 0;
+            atomic<bool> stopRequested{false};
+            mutex safepointMtx;
+            condition_variable safepointCv;
+            mutex heapMtx; // guards the generation lists against allocating mutators
+#else
+            Mutator mainMutator;
+#endif
+
+            // Every heap is independent, a thread allocates in its current one (see `Scope`).
+            unsigned char index = 0;
+            uint64_t id = 0; // unique even if the index is reused
+
+            static Collector* inst; // the default heap
+            static Collector* heaps[];
 
         public:
+            static constexpr size_t MaxHeaps = 64;
+
+            // Makes a heap current on the calling thread for the lifetime of the scope: objects
+            // and pointers created meanwhile belong to it. Pointers of another heap must not be
+            // used (and its collections do not wait for the thread) until the scope ends.
+            class Scope {
+            public:
+                explicit Scope(Collector* c);
+                ~Scope();
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+
+            private:
+                Collector* c;
+                Collector* prev;
+            };
+
+            // Returns the default heap.
             static Collector* get();
+            // Returns the current heap of the calling thread, the default one if none is set.
+            static Collector* current();
+            // Creates a heap independent of the other ones.
+            static Collector* create();
+            // Destroys all objects of the heap, none of its pointers may be left.
+            static void destroy(Collector* c);
             void fullCollect();
             void minorCollect();
             void collect();
+            // Performs bounded work of an incremental full collection, starting a new one if
+            // none is in progress, returns true once the collection is complete. Objects
+            // allocated meanwhile survive it. Other collections complete it first.
+            bool collectStep(std::chrono::microseconds budget);
+            bool isCollecting() { return phase != Phase::Idle; }
+            // Bytes of the nursery filled since the last collection, read without locking.
+            size_t getNurseryBytes() const { return nursery.usedBytes(); }
+            // Bytes allocated since the last collection, in the nursery (counted by pages) and out of
+            // it (large blocks, containers), read without locking.
+            size_t getAllocatedSinceGc() const {
+                return nursery.usedBytes() + allocatedOutOfNursery.load(std::memory_order_relaxed);
+            }
+            // Whether the object is marked by the running (or the last) collection.
+            bool isMarked(const ObjMeta* meta) { return meta->markEpoch == markEpoch; }
+            // Number of threads (including the collecting one) marking during a full collection.
+            void setMarkThreads(unsigned cnt);
+            unsigned getMarkThreads();
+            // Full collections sweep on a background thread: blocks of dead objects with trivial
+            // destructors are released there, other dead objects are queued for `runFinalizers`.
+            void setBackgroundSweep(bool enabled);
+            // Destroys and frees up to `maxCnt` queued dead objects on the calling thread, returns
+            // the number of objects still queued. Collections run all of them first.
+            size_t runFinalizers(size_t maxCnt = SIZE_MAX);
+            // Waits for the background sweeping of the last full collection.
+            void finishSweep();
             void dumpStats();
             std::string getStats();
+            // Returns the object counters and the page statistics.
+            HeapStats getHeapStats();
+            // Returns the counters of the classes having objects allocated in the heap,
+            // the ones with the most live bytes first.
+            vector<ClassStats> getClassStats();
+            // Prints the `maxCnt` classes having the most live bytes.
+            void dumpClassStats(size_t maxCnt = 20);
             size_t getAliveObjectsCount();
             size_t getLastFreedObjectsCount();
-            void resetCounters() { newGenGcCount = fullGcCount = 0; }
-            size_t getNewGenSize() { return newGen.size(); }
-            size_t getOldGenSize() { return oldGen.size(); }
+            void resetCounters() {
+                WorldLock lk(this);
+                stats.minorCollections = stats.fullCollections = 0;
+            }
+            size_t getNewGenSize() {
+                WorldLock lk(this);
+                finishSweep();
+                return newGen.size();
+            }
+            size_t getOldGenSize() {
+                WorldLock lk(this);
+                finishSweep();
+                return oldGen.size();
+            }
+            size_t getRootCount() {
+                WorldLock lk(this);
+                return roots.size();
+            }
+            size_t getRememberedCount() {
+                WorldLock lk(this);
+                return remembered.size();
+            }
+            PageAllocator::Stats getPageStats() {
+                WorldLock lk(this);
+                finishSweep();
+                return pages.getStats();
+            }
             void setGcCondition(GcCondition* c) {
+                WorldLock lk(this);
                 delete gcCond;
                 gcCond = c;
             }
+            // The heap owns the listener, `nullptr` removes it.
+            void setListener(GcListener* l);
+            // Allocations that would make the pages of the heap exceed `bytes` (0 for no limit) collect
+            // harder and harder before failing: a minor collection, a full one, then the out of
+            // memory handler and a full collection again. `std::bad_alloc` is thrown if the limit
+            // is still reached. Pages already reserved are kept.
+            void setHeapLimit(size_t bytes);
+            // Called on the allocating thread to release memory (e.g. drop caches) when collections
+            // are not enough, with the size of the failed allocation. It may use gc pointers, but its
+            // allocations do not call it again. The multi-threaded version may call it on several
+            // threads at once.
+            void setOutOfMemoryHandler(std::function<void(size_t size)> handler);
+            // Records the allocations, the constructions, stores and destructions of pointers and the
+            // collections of the heap into a compact binary file until `stopRecording`, to be replayed
+            // by `tgc_replay` (see `AllocTraceReader`). Objects and pointers created before are not in
+            // the trace, so recording should start with the heap. Returns false if the file can not
+            // be created.
+            bool startRecording(const char* path);
+            // Returns false if the trace could not be written completely (e.g. the disk is full).
+            bool stopRecording();
+            PauseHistogram getPauseHistogram() {
+                WorldLock lk(this);
+                return pauses;
+            }
+            void resetPauseHistogram() {
+                WorldLock lk(this);
+                pauses = PauseHistogram();
+            }
+
+#ifdef TGC_MULTI_THREADED
+            Mutator& mutator();
+            Mutator* currentMutator();
+            void safepoint() {
+                if (stopRequested.load(memory_order_relaxed))
+                    safepointSlow();
+            }
+            // The calling thread does not touch gc pointers until `leaveSafeRegion`,
+            // collections do not wait for it meanwhile.
+            void enterSafeRegion();
+            void leaveSafeRegion();
+#else
+            Mutator& mutator() { return mainMutator; }
+            void safepoint() {}
+            void enterSafeRegion() {}
+            void leaveSafeRegion() {}
+#endif
 
         private:
             Collector();
             ~Collector();
 
+#ifdef TGC_MULTI_THREADED
+            void lockWorld();
+            void unlockWorld();
+            void safepointSlow();
+            void syncMutators();
+            void registerMutator();
+            void unregisterMutator(Mutator* m);
+            bool isCollectorThread() { return worldOwner.load(memory_order_relaxed) == this_thread::get_id(); }
+#else
+            void lockWorld() {}
+            void unlockWorld() {}
+            bool isCollectorThread() { return true; }
+#endif
+
+            // Destructors run while the world is locked allocate in the locked heap.
+            struct WorldLock {
+                Scope scope;
+                Collector* c;
+                WorldLock(Collector* col) : scope(col), c(col) { c->lockWorld(); }
+                ~WorldLock() { c->unlockWorld(); }
+            };
+
+            static Collector* setCurrent(Collector* c);
+
+            // Times the outermost collection run on the calling thread as a pause.
+            struct Pause {
+                Collector* c;
+                Pause(Collector* col);
+                ~Pause();
+            };
+            std::chrono::nanoseconds activeTime();
+            void beginCollection(GcEvent::Kind kind);
+            void endCollection();
+            void beginPhase(GcEvent::Phase phase);
+            void endPhase();
+            void finishEvent(GcEvent& e, std::chrono::nanoseconds start);
+            void setTotals(GcEvent& e);
+
+            template <typename F> void forEachMutator(F&& f) {
+#ifdef TGC_MULTI_THREADED
+                for (size_t i = 0; i < mutatorCnt; i++)
+                    f(*mutators[i]);
+#else
+                f(mainMutator);
+#endif
+            }
+
+            void addRoot(const PtrBase* p);
+            void addRemembered(const PtrBase* p);
+            void removePtr(const PtrBase* p);
+            void shadeFromMutator(ObjMeta* meta);
+            void markCreating();
+            bool allocationMayCollect();
+            void collectIfNeeded();
+            bool reclaim(int attempt, size_t size);
+            void releaseCachedPages();
+
             void sweep(MetaSet& gen);
+            void sweepNursery();
             void promote(ObjMeta* meta);
             ObjMeta* globalFindOwnerMeta(void* obj);
-            void tryRegisterToClass(PtrBase* p);
-            void handleUnrefs();
-            void handleDelayIntergenerationalPtrs();
-            void mark(ObjMeta* meta);
-            void preMark(ObjMeta* meta);
+            ObjMeta* tryRegisterToClass(PtrBase* p);
+            void cleanRemembered();
+            void nextEpoch();
+            void markPending();
+            void queueRoots();
+            void markParallel();
+            void adoptSubPtr(ObjMeta* owner, const PtrBase* p);
+            void adoptElems(bool old);
+            void sweepInBackground(MetaSet& gen);
+            ObjMeta* sweepObj(MetaSet& gen, ObjMeta* meta);
+            void shade(ObjMeta* meta);
+            bool runCycle(std::chrono::steady_clock::time_point deadline);
+            void finishCycle();
             void addMeta(ObjMeta* meta);
+            void addCreatingMeta(ObjMeta* meta);
+            void addNurseryMeta(ObjMeta* meta);
+            HeapStats& localStats();
+            vector<ClassStats>& localClassStats();
+            static ClassStats& statsOf(vector<ClassStats>& table, ClassMeta* klass);
+            void countAlloc(ObjMeta* meta);
+            void objDestroyed(ObjMeta* meta);
+            void countDead(ObjMeta* meta);
         };
 
         struct GcCondition_ObjCnt : GcCondition {
-            int counter = 0;
+            std::atomic<int> counter{0};
             int newGenObjCntToGc = 512;
             size_t oldGenObjCntToFullGc = 1024 * 10;
 
@@ -446,16 +1386,29 @@ namespace tgc2 {
             bool needFullGc(Collector* c) override { return c->getOldGenSize() > oldGenObjCntToFullGc; }
         };
 
+        // Counts bytes instead of objects, so large arrays trigger collections by their size.
+        struct GcCondition_Bytes : GcCondition {
+            size_t allocatedBytesToGc = 8 * 1024 * 1024;
+            size_t oldGenBytesToFullGc = 64 * 1024 * 1024;
+            size_t oldGenBytes = 0; // at the end of the last collection
+
+            bool needMinorGc(Collector* c) override { return c->getAllocatedSinceGc() >= allocatedBytesToGc; }
+            bool needFullGc(Collector* c) override { return oldGenBytes > oldGenBytesToFullGc; }
+            void onCollected(Collector* c, const GcEvent& e) override { oldGenBytes = e.old.bytes; }
+        };
+
         struct GcCondition_Time : GcCondition {
             int gcPeriodMs = 10;
-            clock_t lastGcTime;
+            std::atomic<clock_t> lastGcTime{clock()};
             int newGenGcCntToFullGc = 1024;
-            int newGenGcCnt = 0;
-            int counter = 0;
+            std::atomic<int> newGenGcCnt{0};
+            std::atomic<int> counter{0};
 
             bool needMinorGc(Collector* c) override {
+                if (counter++ <= 1024 * 10)
+                    return false;
                 auto nowClock = clock();
-                if (counter++ > 1024 * 10 && nowClock - lastGcTime > (CLOCKS_PER_SEC / 1000 * gcPeriodMs)) {
+                if (nowClock - lastGcTime > (CLOCKS_PER_SEC / 1000 * gcPeriodMs)) {
                     counter = 0;
                     lastGcTime = nowClock;
                     newGenGcCnt++;
@@ -472,11 +1425,50 @@ namespace tgc2 {
             }
         };
 
+        // Sizes the nursery (the bytes allocated between minor collections) so that minor
+        // collections meet a pause target, from their measured pause per collected byte and
+        // survival rate, and runs a full collection once the heap has grown by `heapGrowth`
+        // since the last one.
+        class GcCondition_Adaptive : public GcCondition {
+        public:
+            static constexpr size_t MinNurseryBytes = 256 * 1024;
+            static constexpr size_t MaxNurseryBytes = 256 * 1024 * 1024;
+            static constexpr size_t MinFullGcBytes = 4 * 1024 * 1024;
+
+            explicit GcCondition_Adaptive(
+                std::chrono::microseconds pauseTarget = std::chrono::milliseconds(1),
+                double heapGrowth = 2.0);
+            bool needMinorGc(Collector* c) override;
+            bool needFullGc(Collector* c) override;
+            void onCollected(Collector* c, const GcEvent& e) override;
+
+            size_t getNurseryBytes() const { return nurseryBytes; }
+            size_t getFullGcBytes() const { return fullGcBytes; }
+            // Smoothed ratio of the bytes surviving minor collections to the bytes they collect.
+            double getSurvivalRate() const { return survivalRate; }
+
+        private:
+            std::chrono::microseconds pauseTarget;
+            double heapGrowth;
+            size_t nurseryBytes = 4 * 1024 * 1024;
+            size_t fullGcBytes = MinFullGcBytes;
+            double nsPerByte = 0; // smoothed minor pause per collected byte
+            double survivalRate = 0;
+            size_t lastAllocated = 0, lastLive = 0;
+        };
+
         //////////////////////////////////////////////////////////////////////////
 
-        inline void gc_collect() { Collector::get()->collect(); }
+        inline void gc_collect() { Collector::current()->collect(); }
 
-        inline Collector* gc_collector() { return Collector::get(); }
+        // Returns the current heap of the calling thread.
+        inline Collector* gc_collector() { return Collector::current(); }
+
+        inline Collector* gc_create_heap() { return Collector::create(); }
+
+        inline void gc_destroy_heap(Collector* c) { Collector::destroy(c); }
+
+        using gc_heap_scope = Collector::Scope;
 
         template <typename T, typename... Args> ObjMeta* gc_new_meta(size_t len, Args&&... args) {
             auto* cls = ClassMeta::get<T>();
@@ -532,8 +1524,9 @@ namespace tgc2 {
 
         template <typename T> ClassMeta* ClassMeta::getRegistered() {
             auto* c = get<T>();
-            if (!c->registered) {
-                gc_new_meta<T>(1)->destroy();
+            if constexpr (!hasGcFields<T>) {
+                if (!c->registered)
+                    gc_new_meta<T>(1)->destroy();
             }
             return c;
         }
@@ -547,10 +1540,12 @@ namespace tgc2 {
         public:
             gc_function() {}
 
-            template <typename F> gc_function(F&& f) : callable(gc_new_meta<Imp<F>>(1, std::forward<F>(f))) {}
+            // The callable is stored by value so that its captured gc pointers are traced as sub pointers.
+            template <typename F>
+            gc_function(F&& f) : callable(gc_new_meta<Imp<decay_t<F>>>(1, std::forward<F>(f))) {}
 
             template <typename F> gc_function& operator=(F&& f) {
-                callable = gc_new_meta<Imp<F>>(1, std::forward<F>(f));
+                callable = gc_new_meta<Imp<decay_t<F>>>(1, std::forward<F>(f));
                 return *this;
             }
 
@@ -570,7 +1565,7 @@ namespace tgc2 {
 
             template <typename F> struct Imp : Callable {
                 F f;
-                Imp(F&& ff) : f(ff) {}
+                template <typename U> Imp(U&& ff) : f(std::forward<U>(ff)) {}
                 R call(A... a) override { return f(a...); }
             };
 
@@ -582,37 +1577,52 @@ namespace tgc2 {
         // Wrap STL Containers
         //////////////////////////////////////////////////////////////////////////
 
-        template <typename C> struct ContainerPtrEnumerator : IPtrEnumerator {
-            C* con;
-            typename C::iterator it;
+        // Base of the trace functions of containers, `len` is the number of containers in the gc object.
+        // `registerElems` registers the classes of the elements together with the container class,
+        // so tracing (e.g. by parallel marking) never allocates a first instance.
+        struct ContainerPtrEnumerator {
+            static void registerElems() {}
+
+            template <typename C, typename F> static void forEach(char* obj, size_t len, F&& f) {
+                auto* con = (C*)obj;
+                for (size_t i = 0; i < len; i++, con++) {
+                    for (auto& elem : *con)
+                        f(elem);
+                }
+            }
+
+            template <typename T> static void registerElem() {
+                if constexpr (sizeof(T) >= sizeof(PtrBase))
+                    ClassMeta::getRegistered<T>();
+            }
 
-            ContainerPtrEnumerator(ClassMeta* c, char* o, size_t l) : con((C*)o), it(con->begin()) {}
-            bool hasNext() { return it != con->end(); }
+            // Traces an element that is not a gc pointer by itself.
+            template <typename T> static void traceElem(const T& elem, PtrVisitor& v) {
+                if constexpr (sizeof(T) >= sizeof(PtrBase)) {
+                    PtrEnumerator<T>::trace(ClassMeta::getRegistered<T>(), (char*)&elem, 1, v);
+                }
+            }
         };
 
         //////////////////////////////////////////////////////////////////////////
         /// Vector
 
-        template <typename T> struct PtrEnumerator<vector<gc<T>>> : ContainerPtrEnumerator<vector<gc<T>>> {
-            using ContainerPtrEnumerator<vector<gc<T>>>::ContainerPtrEnumerator;
-
-            const PtrBase* getNext() override { return this->hasNext() ? &*this->it++ : nullptr; }
+        template <typename T> struct PtrEnumerator<vector<gc<T>>> : ContainerPtrEnumerator {
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<vector<gc<T>>>(obj, len, [&](const gc<T>& p) { v.visit(&p); });
+            }
         };
 
-        template <typename T> struct PtrEnumerator<vector<T>> : ContainerPtrEnumerator<vector<T>> {
-            using ContainerPtrEnumerator<vector<T>>::ContainerPtrEnumerator;
-
-            unique_ptr<IPtrEnumerator> ptrIter = nullptr;
-
-            const PtrBase* getNext() override {
-                if (sizeof(T) < sizeof(gc<T>)) {
-                    return nullptr;
-                }
-                if (!ptrIter) {
-                    ptrIter.reset(
-                        ClassMeta::getRegistered<T>()->enumPtrs(this->con->data(), this->con->size()));
+        template <typename T> struct PtrEnumerator<vector<T>> : ContainerPtrEnumerator {
+            static void registerElems() { registerElem<T>(); }
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                if constexpr (sizeof(T) >= sizeof(PtrBase)) {
+                    // Elements are continuous.
+                    auto* klass = ClassMeta::getRegistered<T>();
+                    auto* con = (vector<T>*)obj;
+                    for (size_t i = 0; i < len; i++, con++)
+                        PtrEnumerator<T>::trace(klass, (char*)con->data(), con->size(), v);
                 }
-                return ptrIter ? ptrIter->getNext() : nullptr;
             }
         };
 
@@ -642,34 +1652,16 @@ namespace tgc2 {
             gc<T>& operator[](int idx) { return (*this->ptr())[idx]; }
         };
 
-        template <typename T> struct PtrEnumerator<deque<gc<T>>> : ContainerPtrEnumerator<deque<gc<T>>> {
-            using ContainerPtrEnumerator<deque<gc<T>>>::ContainerPtrEnumerator;
-
-            const PtrBase* getNext() override { return this->hasNext() ? &*this->it++ : nullptr; }
+        template <typename T> struct PtrEnumerator<deque<gc<T>>> : ContainerPtrEnumerator {
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<deque<gc<T>>>(obj, len, [&](const gc<T>& p) { v.visit(&p); });
+            }
         };
 
-        template <typename T> struct PtrEnumerator<deque<T>> : ContainerPtrEnumerator<deque<T>> {
-            using ContainerPtrEnumerator<deque<T>>::ContainerPtrEnumerator;
-
-            unique_ptr<IPtrEnumerator> ptrIter = nullptr;
-
-            const PtrBase* getNext() override {
-                if (sizeof(T) < sizeof(gc<T>)) {
-                    return nullptr;
-                }
-
-                if (ptrIter) {
-                    if (auto* r = ptrIter->getNext()) {
-                        return r;
-                    }
-                }
-
-                if (this->hasNext()) {
-                    ptrIter.reset(ClassMeta::getRegistered<T>()->enumPtrs(&*this->it++, 1));
-                    return ptrIter ? ptrIter->getNext() : nullptr;
-                } else {
-                    return nullptr;
-                }
+        template <typename T> struct PtrEnumerator<deque<T>> : ContainerPtrEnumerator {
+            static void registerElems() { registerElem<T>(); }
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<deque<T>>(obj, len, [&](const T& elem) { traceElem(elem, v); });
             }
         };
 
@@ -689,34 +1681,16 @@ namespace tgc2 {
 
         template <typename T> using gc_list = gc<list<gc<T>>>;
 
-        template <typename T> struct PtrEnumerator<list<gc<T>>> : ContainerPtrEnumerator<list<gc<T>>> {
-            using ContainerPtrEnumerator<list<gc<T>>>::ContainerPtrEnumerator;
-
-            const PtrBase* getNext() override { return this->hasNext() ? &*this->it++ : nullptr; }
+        template <typename T> struct PtrEnumerator<list<gc<T>>> : ContainerPtrEnumerator {
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<list<gc<T>>>(obj, len, [&](const gc<T>& p) { v.visit(&p); });
+            }
         };
 
-        template <typename T> struct PtrEnumerator<list<T>> : ContainerPtrEnumerator<list<T>> {
-            using ContainerPtrEnumerator<list<T>>::ContainerPtrEnumerator;
-
-            unique_ptr<IPtrEnumerator> ptrIter;
-
-            const PtrBase* getNext() override {
-                if (sizeof(T) < sizeof(gc<T>)) {
-                    return nullptr;
-                }
-
-                if (ptrIter) {
-                    if (auto* r = ptrIter->getNext()) {
-                        return r;
-                    }
-                }
-
-                if (this->hasNext()) {
-                    ptrIter.reset(ClassMeta::getRegistered<T>()->enumPtrs(&*this->it++, 1));
-                    return ptrIter ? ptrIter->getNext() : nullptr;
-                } else {
-                    return nullptr;
-                }
+        template <typename T> struct PtrEnumerator<list<T>> : ContainerPtrEnumerator {
+            static void registerElems() { registerElem<T>(); }
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<list<T>>(obj, len, [&](const T& elem) { traceElem(elem, v); });
             }
         };
 
@@ -741,44 +1715,16 @@ namespace tgc2 {
             gc<V>& operator[](const K& k) { return (*this->ptr())[k]; }
         };
 
-        template <typename K, typename V>
-        struct PtrEnumerator<map<K, gc<V>>> : ContainerPtrEnumerator<map<K, gc<V>>> {
-            using ContainerPtrEnumerator<map<K, gc<V>>>::ContainerPtrEnumerator;
-
-            const PtrBase* getNext() override {
-                if (!this->hasNext())
-                    return nullptr;
-                auto* ret = &this->it->second;
-                ++this->it;
-                return ret;
+        template <typename K, typename V> struct PtrEnumerator<map<K, gc<V>>> : ContainerPtrEnumerator {
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<map<K, gc<V>>>(obj, len, [&](const pair<const K, gc<V>>& elem) { v.visit(&elem.second); });
             }
         };
 
-        template <typename K, typename V>
-        struct PtrEnumerator<map<K, V>> : ContainerPtrEnumerator<map<K, V>> {
-            using ContainerPtrEnumerator<map<K, V>>::ContainerPtrEnumerator;
-
-            unique_ptr<IPtrEnumerator> ptrIter;
-
-            const PtrBase* getNext() override {
-                if (sizeof(V) < sizeof(gc<V>)) {
-                    return nullptr;
-                }
-
-                if (ptrIter) {
-                    if (auto* r = ptrIter->getNext()) {
-                        return r;
-                    }
-                }
-
-                if (this->hasNext()) {
-                    auto* elem = &this->it->second;
-                    this->it++;
-                    ptrIter.reset(ClassMeta::getRegistered<V>()->enumPtrs(elem, 1));
-                    return ptrIter ? ptrIter->getNext() : nullptr;
-                } else {
-                    return nullptr;
-                }
+        template <typename K, typename V> struct PtrEnumerator<map<K, V>> : ContainerPtrEnumerator {
+            static void registerElems() { registerElem<V>(); }
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<map<K, V>>(obj, len, [&](const pair<const K, V>& elem) { traceElem(elem.second, v); });
             }
         };
 
@@ -803,44 +1749,16 @@ namespace tgc2 {
             gc<V>& operator[](const K& k) { return (*this->ptr())[k]; }
         };
 
-        template <typename K, typename V>
-        struct PtrEnumerator<unordered_map<K, gc<V>>> : ContainerPtrEnumerator<unordered_map<K, gc<V>>> {
-            using ContainerPtrEnumerator<unordered_map<K, gc<V>>>::ContainerPtrEnumerator;
-
-            const PtrBase* getNext() override {
-                if (!this->hasNext())
-                    return nullptr;
-                auto* ret = &this->it->second;
-                ++this->it;
-                return ret;
+        template <typename K, typename V> struct PtrEnumerator<unordered_map<K, gc<V>>> : ContainerPtrEnumerator {
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<unordered_map<K, gc<V>>>(obj, len, [&](const pair<const K, gc<V>>& elem) { v.visit(&elem.second); });
             }
         };
 
-        template <typename K, typename V>
-        struct PtrEnumerator<unordered_map<K, V>> : ContainerPtrEnumerator<unordered_map<K, V>> {
-            using ContainerPtrEnumerator<unordered_map<K, V>>::ContainerPtrEnumerator;
-
-            unique_ptr<IPtrEnumerator> ptrIter;
-
-            const PtrBase* getNext() override {
-                if (sizeof(V) < sizeof(gc<V>)) {
-                    return nullptr;
-                }
-
-                if (ptrIter) {
-                    if (auto* r = ptrIter->getNext()) {
-                        return r;
-                    }
-                }
-
-                if (this->hasNext()) {
-                    auto* elem = &this->it->second;
-                    this->it++;
-                    ptrIter.reset(ClassMeta::getRegistered<V>()->enumPtrs(elem, 1));
-                    return ptrIter ? ptrIter->getNext() : nullptr;
-                } else {
-                    return nullptr;
-                }
+        template <typename K, typename V> struct PtrEnumerator<unordered_map<K, V>> : ContainerPtrEnumerator {
+            static void registerElems() { registerElem<V>(); }
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<unordered_map<K, V>>(obj, len, [&](const pair<const K, V>& elem) { traceElem(elem.second, v); });
             }
         };
 
@@ -860,34 +1778,16 @@ namespace tgc2 {
 
         template <typename V> using gc_set = gc<set<gc<V>>>;
 
-        template <typename V> struct PtrEnumerator<set<gc<V>>> : ContainerPtrEnumerator<set<gc<V>>> {
-            using ContainerPtrEnumerator<set<gc<V>>>::ContainerPtrEnumerator;
-
-            const PtrBase* getNext() override { return this->hasNext() ? &*this->it++ : nullptr; }
+        template <typename V> struct PtrEnumerator<set<gc<V>>> : ContainerPtrEnumerator {
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<set<gc<V>>>(obj, len, [&](const gc<V>& p) { v.visit(&p); });
+            }
         };
 
-        template <typename V> struct PtrEnumerator<set<V>> : ContainerPtrEnumerator<set<V>> {
-            using ContainerPtrEnumerator<set<V>>::ContainerPtrEnumerator;
-
-            unique_ptr<IPtrEnumerator> ptrIter;
-
-            const PtrBase* getNext() override {
-                if (sizeof(V) < sizeof(gc<V>)) {
-                    return nullptr;
-                }
-
-                if (ptrIter) {
-                    if (auto* r = ptrIter->getNext()) {
-                        return r;
-                    }
-                }
-
-                if (this->hasNext()) {
-                    ptrIter.reset(ClassMeta::getRegistered<V>()->enumPtrs(&*this->it++, 1));
-                    return ptrIter ? ptrIter->getNext() : nullptr;
-                } else {
-                    return nullptr;
-                }
+        template <typename V> struct PtrEnumerator<set<V>> : ContainerPtrEnumerator {
+            static void registerElems() { registerElem<V>(); }
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<set<V>>(obj, len, [&](const V& elem) { traceElem(elem, v); });
             }
         };
 
@@ -907,36 +1807,16 @@ namespace tgc2 {
 
         template <typename V> using gc_unordered_set = gc<unordered_set<gc<V>>>;
 
-        template <typename V>
-        struct PtrEnumerator<unordered_set<gc<V>>> : ContainerPtrEnumerator<unordered_set<gc<V>>> {
-            using ContainerPtrEnumerator<unordered_set<gc<V>>>::ContainerPtrEnumerator;
-
-            const PtrBase* getNext() override { return this->hasNext() ? &*this->it++ : nullptr; }
+        template <typename V> struct PtrEnumerator<unordered_set<gc<V>>> : ContainerPtrEnumerator {
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<unordered_set<gc<V>>>(obj, len, [&](const gc<V>& p) { v.visit(&p); });
+            }
         };
 
-        template <typename V>
-        struct PtrEnumerator<unordered_set<V>> : ContainerPtrEnumerator<unordered_set<V>> {
-            using ContainerPtrEnumerator<unordered_set<V>>::ContainerPtrEnumerator;
-
-            unique_ptr<IPtrEnumerator> ptrIter;
-
-            const PtrBase* getNext() override {
-                if (sizeof(V) < sizeof(gc<V>)) {
-                    return nullptr;
-                }
-
-                if (ptrIter) {
-                    if (auto* r = ptrIter->getNext()) {
-                        return r;
-                    }
-                }
-
-                if (this->hasNext()) {
-                    ptrIter.reset(ClassMeta::getRegistered<V>()->enumPtrs(&*this->it++, 1));
-                    return ptrIter ? ptrIter->getNext() : nullptr;
-                } else {
-                    return nullptr;
-                }
+        template <typename V> struct PtrEnumerator<unordered_set<V>> : ContainerPtrEnumerator {
+            static void registerElems() { registerElem<V>(); }
+            static void trace(ClassMeta*, char* obj, size_t len, PtrVisitor& v) {
+                forEach<unordered_set<V>>(obj, len, [&](const V& elem) { traceElem(elem, v); });
             }
         };
 
@@ -959,6 +1839,9 @@ namespace tgc2 {
     using details::gc;
     using details::gc_collect;
     using details::gc_collector;
+    using details::gc_create_heap;
+    using details::gc_destroy_heap;
+    using details::gc_heap_scope;
     using details::gc_dynamic_pointer_cast;
     using details::gc_from;
     using details::gc_function;
@@ -1,13 +1,22 @@
 #include <assert.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <thread>
 
 #include "tgc2.h"
 
 using namespace tgc2;
 using namespace std;
 
+// Tests counting objects or collections only collect when asked, the default condition is
+// restored at the end of their scope.
+struct ManualCollection {
+    ManualCollection() { gc_collector()->setGcCondition(nullptr); }
+    ~ManualCollection() { gc_collector()->setGcCondition(new details::GcCondition_Adaptive); }
+};
+
 struct b1 {
     b1(const string& s) : name(s) { cout << "Creating b1(" << name << ")." << endl; }
     virtual ~b1() { cout << "Destroying b1(" << name << ")." << endl; }
@@ -315,7 +324,7 @@ void testException() {
     }
     assert(err);
     assert(c.dctorCnt == c.len - 1);
-    assert(details::ClassMeta::get<Test>()->isCreatingObj == 0);
+    assert(gc_collector()->mutator().isCreatingObj == 0);
 }
 
 void testCollection() {
@@ -333,6 +342,1068 @@ void testCollection() {
         gc_collect();
         gc_collector()->dumpStats();
     }
+
+    // The first instance of a class may be an array.
+    struct Cell {
+        gc<int> value;
+    };
+    auto cells = gc_new_array<Cell>(3);
+    for (int i = 0; i < 3; i++)
+        (&*cells)[i].value = gc_new<int>(i);
+    gc_collector()->fullCollect();
+    assert(details::ClassMeta::get<Cell>()->subPtrOffsets->size() == 1);
+    for (int i = 0; i < 3; i++)
+        assert(*(&*cells)[i].value == i);
+}
+
+void testPageAllocator() {
+    using details::PageAllocator;
+
+    gc_collector()->fullCollect();
+    auto stats = gc_collector()->getPageStats();
+    {
+        // Containers are not allocated in the nursery.
+        vector<gc_vector<int>> vectors;
+        for (int i = 0; i < 1000; i++)
+            vectors.push_back(gc_new_vector<int>());
+        assert(gc_collector()->getPageStats().usedSlots == stats.usedSlots + 1000);
+        assert(gc_collector()->getPageStats().occupancy() > 0);
+
+        auto big = gc_new_array<char>(PageAllocator::PageSize * 2);
+        assert(gc_collector()->getPageStats().largePageCount == stats.largePageCount + 1);
+    }
+    gc_collector()->fullCollect();
+    assert(gc_collector()->getPageStats().usedSlots == stats.usedSlots);
+    assert(gc_collector()->getPageStats().largePageCount == stats.largePageCount);
+}
+
+void testNursery() {
+    static int dctorCnt = 0;
+    struct Finalizable {
+        ~Finalizable() { dctorCnt++; }
+    };
+    ManualCollection manual;
+
+    gc_collector()->fullCollect();
+    auto aliveCnt = gc_collector()->getAliveObjectsCount();
+    {
+        gc<int> survivor = gc_new<int>(7);
+        for (int i = 0; i < 100000; i++)
+            gc<int> p(i);
+        for (int i = 0; i < 10; i++)
+            gc_new<Finalizable>();
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + 100011);
+        assert(gc_collector()->getPageStats().nurseryPageCount > 0);
+
+        gc_collector()->minorCollect();
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + 1);
+        assert(dctorCnt == 10);
+        assert(*survivor == 7);
+    }
+    gc_collector()->fullCollect();
+    assert(gc_collector()->getAliveObjectsCount() == aliveCnt);
+
+    // Sparse survivors do not hold their pages, the holes between them are reused.
+    struct Small {
+        gc<Small> next;
+        char payload[48];
+    };
+    const size_t mb = 1 << 20;
+    auto* heap = gc_create_heap();
+    heap->setGcCondition(nullptr);
+    heap->setHeapLimit(32 * mb);
+    {
+        gc_heap_scope scope(heap);
+        vector<gc<Small>> kept;
+        for (int round = 0; round < 50; round++) {
+            for (int i = 0; i < 100000; i++) {
+                auto p = gc_new<Small>();
+                if (i % 1000 == 0)
+                    kept.push_back(p);
+            }
+            heap->minorCollect();
+        }
+        assert(kept.size() == 5000);
+        assert(heap->getHeapStats().pages.reservedBytes < 16 * mb);
+
+        // Pages are rewound once their survivors are gone.
+        kept.clear();
+        heap->fullCollect();
+        heap->minorCollect();
+        assert(heap->getHeapStats().pages.reservedBytes <=
+               details::Nursery::FreePagesToKeep * details::PageAllocator::PageSize);
+    }
+    gc_destroy_heap(heap);
+}
+
+void testRootTable() {
+    struct Node {
+        gc<Node> next;
+    };
+
+    auto rootCnt = gc_collector()->getRootCount();
+    {
+        gc<Node> a = gc_new<Node>();
+        gc<Node> b = a;
+        {
+            gc<Node> c;
+            assert(gc_collector()->getRootCount() == rootCnt + 3);
+        }
+        // Sub pointers are not roots.
+        a->next = gc_new<Node>();
+        assert(gc_collector()->getRootCount() == rootCnt + 2);
+    }
+    assert(gc_collector()->getRootCount() == rootCnt);
+
+    // Neither are the ones of objects outside of the nursery, pointers in other heap memory are.
+    struct Big {
+        gc<Node> first;
+        char payload[details::PageAllocator::PageSize - 64]; // `last` is on the next page unit
+        gc<Node> last;
+    };
+    {
+        auto big = gc_new<Big>();
+        assert(gc_collector()->getRootCount() == rootCnt + 1);
+        auto* plain = new gc<Node>(big->first);
+        assert(gc_collector()->getRootCount() == rootCnt + 2);
+        delete plain;
+    }
+    assert(gc_collector()->getRootCount() == rootCnt);
+
+    int notGc = 0;
+    bool thrown = false;
+    try {
+        gc_from(&notGc);
+    } catch (std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void testRememberedSet() {
+    struct Node {
+        gc<Node> next;
+        int value = 0;
+    };
+
+    gc<Node> old = gc_new<Node>();
+    // Survive enough minor collections to be promoted.
+    gc_collector()->minorCollect();
+    gc_collector()->minorCollect();
+    auto rememberedCnt = gc_collector()->getRememberedCount();
+
+    old->next = gc_new<Node>();
+    old->next->value = 42;
+    assert(gc_collector()->getRememberedCount() == rememberedCnt + 1);
+
+    // The young object is only reachable from the old one.
+    gc_collector()->minorCollect();
+    assert(old->next->value == 42);
+
+    // Dropped from the remembered set once promoted too.
+    gc_collector()->minorCollect();
+    assert(gc_collector()->getRememberedCount() == rememberedCnt);
+    assert(old->next->value == 42);
+}
+
+void testDeclaredFields() {
+    static int dctorCnt = 0;
+    struct Keyed {
+        Keyed(int k) : key(k) {}
+        ~Keyed() { dctorCnt++; }
+
+        int key;
+        gc<Keyed> next;
+        gc<Keyed> prev;
+        TGC_FIELDS(Keyed, &Keyed::next, &Keyed::prev);
+    };
+    static_assert(details::hasGcFields<Keyed>);
+
+    gc_collector()->fullCollect();
+    auto rootCnt = gc_collector()->getRootCount();
+    {
+        // Registered without ever constructing an instance.
+        assert(details::ClassMeta::get<Keyed>()->registered);
+
+        gc<Keyed> a = gc_new<Keyed>(1);
+        a->next = gc_new<Keyed>(2);
+        a->next->prev = a;
+        assert(gc_collector()->getRootCount() == rootCnt + 1);
+
+        // Not default constructible, but traceable inside containers.
+        auto keys = gc_new<vector<Keyed>>();
+        keys->emplace_back(3);
+        keys->back().next = a;
+        a = nullptr;
+
+        gc_collector()->fullCollect();
+        assert(dctorCnt == 0);
+        assert(keys->back().next->next->key == 2);
+    }
+    gc_collector()->fullCollect();
+    assert(dctorCnt == 3);
+    assert(gc_collector()->getRootCount() == rootCnt);
+
+    // A member left out of the declaration keeps its object alive as a root.
+    static int leafDctorCnt = 0;
+    struct Leaf {
+        ~Leaf() { leafDctorCnt++; }
+    };
+    struct Partial {
+        gc<Leaf> a, b;
+        TGC_FIELDS(Partial, &Partial::a);
+    };
+    {
+        auto n = gc_new<Partial>();
+        n->a = gc_new<Leaf>();
+        n->b = gc_new<Leaf>();
+        assert(gc_collector()->getRootCount() == rootCnt + 2);
+        gc_collector()->fullCollect();
+        assert(leafDctorCnt == 0);
+    }
+    // The root is only dropped by the destructor of its owner, its object goes one collection later.
+    gc_collector()->fullCollect();
+    assert(leafDctorCnt == 1);
+    gc_collector()->fullCollect();
+    assert(leafDctorCnt == 2);
+    assert(gc_collector()->getRootCount() == rootCnt);
+}
+
+void testIncrementalCollection() {
+    struct Node {
+        gc<Node> next;
+        int value = 0;
+    };
+
+    gc_collector()->fullCollect();
+    auto aliveCnt = gc_collector()->getAliveObjectsCount();
+    {
+        const int len = 1000;
+        gc<Node> list = gc_new<Node>();
+        Node* beforeLast = nullptr;
+        auto* cur = list.operator->();
+        for (int i = 0; i < len; i++) {
+            beforeLast = cur;
+            cur->next = gc_new<Node>();
+            cur = cur->next.operator->();
+        }
+        cur->value = 42;
+        for (int i = 0; i < 100; i++)
+            gc_new<Node>();
+        // Rooted last, so scanned first.
+        gc<Node> holder = gc_new<Node>();
+
+        int steps = 0;
+        bool moved = false;
+        while (!gc_collector()->collectStep(std::chrono::microseconds(0))) {
+            assert(gc_collector()->isCollecting());
+            steps++;
+            // Hide a not yet marked object in an already scanned one.
+            if (!moved && gc_collector()->isMarked(holder.getMeta()) &&
+                !gc_collector()->isMarked(beforeLast->next.getMeta())) {
+                holder->next = beforeLast->next;
+                beforeLast->next = nullptr;
+                moved = true;
+            }
+            // Allocated during the collection, survives it.
+            gc_new<Node>();
+        }
+        assert(moved && steps > 1);
+        assert(holder->next->value == 42);
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + len + 2 + steps);
+
+        gc_collector()->fullCollect();
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + len + 2);
+        assert(holder->next->value == 42);
+    }
+    gc_collector()->fullCollect();
+    assert(gc_collector()->getAliveObjectsCount() == aliveCnt);
+}
+
+void testParallelMarking() {
+    struct Node {
+        gc<Node> left, right;
+        gc_vector<Node> links = gc_new_vector<Node>();
+    };
+
+    gc_collector()->fullCollect();
+    auto aliveCnt = gc_collector()->getAliveObjectsCount();
+    gc_collector()->setMarkThreads(4);
+    assert(gc_collector()->getMarkThreads() == 4);
+    {
+        // Every node holds a vector: two objects per node.
+        const int depth = 14, nodeCnt = (1 << depth) - 1;
+        auto build = [](int d, auto& self) -> gc<Node> {
+            auto n = gc_new<Node>();
+            if (d > 1) {
+                n->left = self(d - 1, self);
+                n->right = self(d - 1, self);
+                n->links->push_back(n->left);
+                n->links->push_back(n);
+            }
+            return n;
+        };
+        gc<Node> tree = build(depth, build);
+        for (int i = 0; i < 1000; i++)
+            gc_new<Node>();
+
+        gc_collector()->fullCollect();
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + nodeCnt * 2);
+        gc_collector()->fullCollect();
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + nodeCnt * 2);
+
+        // Only reachable through the vector of the root.
+        tree->left = nullptr;
+        gc_collector()->fullCollect();
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + nodeCnt * 2);
+        tree->links->clear();
+        gc_collector()->fullCollect();
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + (nodeCnt / 2 + 1) * 2);
+    }
+    gc_collector()->fullCollect();
+    assert(gc_collector()->getAliveObjectsCount() == aliveCnt);
+    gc_collector()->setMarkThreads(1);
+}
+
+void testBackgroundSweep() {
+    static int dctorCnt = 0;
+    struct Finalizable {
+        ~Finalizable() { dctorCnt++; }
+    };
+
+    gc_collector()->fullCollect();
+    auto aliveCnt = gc_collector()->getAliveObjectsCount();
+    auto usedSlots = gc_collector()->getPageStats().usedSlots;
+    gc_collector()->setBackgroundSweep(true);
+    {
+        vector<gc<int>> ints;
+        vector<gc<Finalizable>> objs;
+        for (int i = 0; i < 1000; i++) {
+            ints.push_back(gc_new<int>(i));
+            objs.push_back(gc_new<Finalizable>());
+        }
+        // Pinned out of the nursery.
+        gc_collector()->minorCollect();
+    }
+    gc_collector()->fullCollect();
+    {
+        // Allocating from the pages while they are released by the sweeper.
+        vector<gc_vector<int>> vectors;
+        for (int i = 0; i < 1000; i++)
+            vectors.push_back(gc_new_vector<int>());
+    }
+    gc_collector()->finishSweep();
+    assert(gc_collector()->getLastFreedObjectsCount() == 2000);
+    assert(dctorCnt == 0);
+
+    // Destructors run in batches on this thread.
+    assert(gc_collector()->runFinalizers(100) == 900);
+    assert(dctorCnt == 100);
+    gc_collector()->fullCollect();
+    assert(dctorCnt == 1000);
+
+    // Old objects die with the young ones they remember, freed by the sweeper meanwhile.
+    struct Holder {
+        gc<char> young;
+    };
+    {
+        vector<gc<Holder>> holders;
+        for (int i = 0; i < 4000; i++)
+            holders.push_back(gc_new<Holder>());
+        gc_collector()->minorCollect();
+        gc_collector()->minorCollect();
+        for (auto& h : holders)
+            h->young = gc_new_array<char>(9 * 1024);
+    }
+    gc_collector()->fullCollect();
+    gc_collector()->fullCollect();
+
+    gc_collector()->setBackgroundSweep(false);
+    gc_collector()->fullCollect();
+    assert(gc_collector()->getAliveObjectsCount() == aliveCnt);
+    assert(gc_collector()->getPageStats().usedSlots == usedSlots);
+}
+
+void testMultiThreaded() {
+#ifdef TGC_MULTI_THREADED
+    struct Node {
+        int value = 0;
+        gc<Node> next;
+        gc_vector<int> values = gc_new_vector<int>();
+    };
+
+    gc_collector()->fullCollect();
+    auto aliveCnt = gc_collector()->getAliveObjectsCount();
+    {
+        // Every thread builds its own chain while the others collect.
+        const int threadCnt = 4, nodeCnt = 2000;
+        vector<gc<Node>> heads(threadCnt);
+        vector<thread> threads;
+        for (int t = 0; t < threadCnt; t++) {
+            threads.emplace_back([&heads, t] {
+                gc<Node> head;
+                for (int i = 0; i < nodeCnt; i++) {
+                    auto n = gc_new<Node>();
+                    n->value = i;
+                    n->next = head;
+                    n->values->push_back(gc_new<int>(i));
+                    head = n;
+                    if (i % 500 == t)
+                        t % 2 ? gc_collector()->fullCollect() : gc_collector()->minorCollect();
+                    else if (i % 100 == t)
+                        gc_collector()->collectStep(std::chrono::microseconds(50));
+                }
+                heads[t] = head;
+            });
+        }
+        // Collections of the other threads do not wait for this blocked one.
+        gc_collector()->enterSafeRegion();
+        for (auto& t : threads)
+            t.join();
+        gc_collector()->leaveSafeRegion();
+
+        gc_collector()->fullCollect();
+        assert(gc_collector()->getAliveObjectsCount() == aliveCnt + threadCnt * nodeCnt * 3);
+        for (auto& head : heads) {
+            int expected = nodeCnt;
+            for (auto n = head; n; n = n->next) {
+                expected--;
+                assert(n->value == expected && *(*n->values)[0] == expected);
+            }
+            assert(expected == 0);
+        }
+
+        // Pointers created on a thread and destroyed by another one.
+        vector<gc<int>> ints;
+        gc_collector()->enterSafeRegion();
+        thread([&] {
+            for (int i = 0; i < 1000; i++)
+                ints.push_back(gc_new<int>(i));
+        }).join();
+        gc_collector()->leaveSafeRegion();
+        ints.clear();
+
+        // A thread blocked in a safe region does not hold collections back.
+        mutex mtx;
+        mtx.lock();
+        thread blocked([&] {
+            auto p = gc_new<int>(1);
+            gc_collector()->enterSafeRegion();
+            lock_guard<mutex> lk(mtx);
+            gc_collector()->leaveSafeRegion();
+            assert(*p == 1);
+        });
+        this_thread::sleep_for(std::chrono::milliseconds(10));
+        gc_collector()->fullCollect();
+        mtx.unlock();
+        blocked.join();
+
+        // Promoted while under construction (collections wait for it at its allocations), the
+        // pointers constructed afterwards are old ones.
+        static int leafDctorCnt = 0;
+        struct Leaf {
+            ~Leaf() { leafDctorCnt++; }
+        };
+        struct Late {
+            gc<Leaf> first;
+            bool promoted = [] {
+                gc_collector()->minorCollect();
+                gc_collector()->minorCollect();
+                return true;
+            }();
+            gc<Leaf> last = gc_new<Leaf>();
+        };
+        auto late = gc_new<Late>();
+        assert(late.getMeta()->isOld);
+        gc_collector()->minorCollect();
+        assert(leafDctorCnt == 0);
+    }
+    gc_collector()->fullCollect();
+    assert(gc_collector()->getAliveObjectsCount() == aliveCnt);
+#endif
+}
+
+void testHeaps() {
+    static int dctorCnt = 0;
+    struct Node {
+        gc<Node> next;
+        ~Node() { dctorCnt++; }
+    };
+
+    auto* defaultHeap = gc_collector();
+    defaultHeap->fullCollect();
+    auto aliveCnt = defaultHeap->getAliveObjectsCount();
+    {
+        auto* heap = gc_create_heap();
+        {
+            gc_heap_scope scope(heap);
+            assert(gc_collector() == heap);
+            auto n = gc_new<Node>();
+            n->next = gc_new<Node>();
+            gc_new<Node>();
+            gc_collect();
+            assert(heap->getAliveObjectsCount() == 2 && dctorCnt == 1);
+            assert(defaultHeap->getAliveObjectsCount() == aliveCnt);
+        }
+        assert(gc_collector() == defaultHeap);
+        heap->fullCollect();
+        assert(heap->getAliveObjectsCount() == 0 && dctorCnt == 3);
+
+        // Remaining objects are destroyed with their heap.
+        {
+            gc_heap_scope scope(heap);
+            gc_new<Node>();
+        }
+        gc_destroy_heap(heap);
+        assert(dctorCnt == 4);
+    }
+
+    // Every thread collects its own heap, this one is not waited for while joining them.
+    struct Link {
+        gc<Link> next;
+    };
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([] {
+            const int linkCnt = 10000;
+            auto* heap = gc_create_heap();
+            {
+                gc_heap_scope scope(heap);
+                gc<Link> head;
+                for (int i = 0; i < linkCnt; i++) {
+                    auto l = gc_new<Link>();
+                    l->next = head;
+                    head = l;
+                    if (i % 1000 == 0)
+                        gc_collector()->fullCollect();
+                }
+                gc_collector()->fullCollect();
+                assert(gc_collector()->getAliveObjectsCount() == linkCnt);
+            }
+            gc_destroy_heap(heap);
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    assert(defaultHeap->getAliveObjectsCount() == aliveCnt);
+}
+
+void testMarkEpochs() {
+    struct Node {
+        gc<Node> next;
+        int value = 0;
+    };
+
+    // A new heap starts from the first epoch.
+    auto* heap = gc_create_heap();
+    {
+        gc_heap_scope scope(heap);
+        auto old = gc_new<Node>();
+        heap->minorCollect();
+        heap->minorCollect();
+        assert(old.getMeta()->isOld);
+
+        // Minor collections do not mark old objects, let the epoch come back to the one of `old`:
+        // it is still unmarked when the full collection starts.
+        for (int i = 0; i < 0xffff - 1; i++)
+            heap->minorCollect();
+        old->next = gc_new<Node>();
+        old->next->value = 42;
+        heap->fullCollect();
+        assert(heap->getAliveObjectsCount() == 2);
+        assert(old->next->value == 42);
+    }
+    gc_destroy_heap(heap);
+}
+
+void testHeapStats() {
+    struct Node {
+        gc<Node> next;
+        int value = 0;
+    };
+    auto checkTotals = [](const details::HeapStats& s) {
+        assert(s.allocated.objects - s.freed.objects == s.live().objects);
+        assert(s.allocated.bytes - s.freed.bytes == s.live().bytes);
+    };
+
+    auto* heap = gc_create_heap();
+    {
+        gc_heap_scope scope(heap);
+        gc<Node> head;
+        for (int i = 0; i < 100; i++) {
+            auto n = gc_new<Node>();
+            if (i % 2 == 0) {
+                n->next = head;
+                head = n;
+            }
+        }
+        auto s = heap->getHeapStats();
+        assert(s.allocated.objects == 100 && s.nursery.objects == 100);
+        assert(s.nursery.bytes >= 100 * sizeof(Node) && s.young.objects == 0);
+        checkTotals(s);
+
+        // Survivors leave the nursery, then get promoted by the second collection.
+        heap->minorCollect();
+        s = heap->getHeapStats();
+        assert(s.nursery.objects == 0 && s.young.objects == 50 && s.old.objects == 0);
+        assert(s.lastFreed.objects == 50 && s.freed.objects == 50 && s.minorCollections == 1);
+        checkTotals(s);
+        heap->minorCollect();
+        s = heap->getHeapStats();
+        assert(s.young.objects == 0 && s.old.objects == 50 && s.promoted.objects == 50);
+        assert(s.lastFreed.objects == 0);
+        checkTotals(s);
+
+        // Destroyed objects are freed at once, big ones skip the nursery.
+        auto next = head->next;
+        gc_delete(head);
+        auto big = gc_new_array<char>(details::Nursery::MaxObjectSize);
+        s = heap->getHeapStats();
+        assert(s.old.objects == 49 && s.freed.objects == 51 && s.young.objects == 1);
+        assert(s.young.bytes > details::Nursery::MaxObjectSize);
+        checkTotals(s);
+
+        next = nullptr;
+        big = nullptr;
+        heap->fullCollect();
+        s = heap->getHeapStats();
+        assert(s.live().objects == 0 && s.live().bytes == 0);
+        assert(s.lastFreed.objects == 50 && s.fullCollections == 1);
+        assert(heap->getAliveObjectsCount() == 0 && heap->getLastFreedObjectsCount() == 50);
+        checkTotals(s);
+    }
+    gc_destroy_heap(heap);
+}
+
+void testClassStats() {
+    struct Leaf {
+        int value = 0;
+    };
+    struct Branch {
+        gc<Leaf> leaf;
+        char payload[64];
+    };
+    assert(details::ClassMeta::get<int>()->name() == "int");
+    assert(details::ClassMeta::get<Leaf>()->name().find("Leaf") != string_view::npos);
+
+    auto* heap = gc_create_heap();
+    {
+        gc_heap_scope scope(heap);
+        vector<gc<Branch>> branches;
+        for (int i = 0; i < 10; i++) {
+            branches.push_back(gc_new<Branch>());
+            branches.back()->leaf = gc_new<Leaf>();
+            gc_new<Leaf>();
+        }
+        auto s = heap->getClassStats();
+        assert(s.size() == 2 && s[0].klass == details::ClassMeta::get<Branch>());
+        assert(s[0].allocated == 10 && s[0].live.objects == 10);
+        assert(s[1].allocated == 20 && s[1].live.objects == 20);
+        assert(s[0].live.bytes > s[1].live.bytes);
+
+        heap->minorCollect();
+        heap->minorCollect();
+        s = heap->getClassStats();
+        assert(s[1].freed == 10 && s[1].live.objects == 10 && s[1].survived == 20);
+        assert(s[0].promoted == 10 && s[1].promoted == 10);
+
+        gc_delete(branches[0]);
+        s = heap->getClassStats();
+        assert(s[0].freed == 1 && s[0].live.objects == 9);
+        heap->dumpClassStats();
+
+        branches.clear();
+        heap->fullCollect();
+        for (auto& cs : heap->getClassStats())
+            assert(cs.live.objects == 0 && cs.live.bytes == 0 && cs.allocated == cs.freed);
+    }
+    gc_destroy_heap(heap);
+}
+
+void testGcListener() {
+    using details::GcEvent;
+    struct Recorder : details::GcListener {
+        vector<GcEvent> begun, ended;
+        void onBegin(details::Collector*, const GcEvent& e) override { begun.push_back(e); }
+        void onEnd(details::Collector*, const GcEvent& e) override { ended.push_back(e); }
+    };
+    struct Node {
+        gc<Node> next;
+    };
+
+    auto* heap = gc_create_heap();
+    auto* rec = new Recorder;
+    heap->setListener(rec);
+    {
+        gc_heap_scope scope(heap);
+        gc<Node> head = gc_new<Node>();
+        head->next = gc_new<Node>();
+        for (int i = 0; i < 10; i++)
+            gc_new<Node>();
+
+        heap->minorCollect();
+        // The collection and its Finalize, Roots, Mark and Sweep phases.
+        assert(rec->begun.size() == 5 && rec->ended.size() == 5);
+        auto& minor = rec->ended.back();
+        assert(minor.kind == GcEvent::Kind::Minor && minor.phase == GcEvent::Phase::None);
+        assert(minor.marked.objects == 2 && minor.freed.objects == 10 && minor.promoted.objects == 0);
+        assert(rec->ended[2].phase == GcEvent::Phase::Mark && rec->ended[2].marked.objects == 2);
+        assert(rec->ended[3].phase == GcEvent::Phase::Sweep && rec->ended[3].freed.objects == 10);
+        assert(minor.duration >= rec->ended[2].duration);
+
+        heap->minorCollect();
+        assert(rec->ended.back().promoted.objects == 2);
+
+        rec->ended.clear();
+        head->next = nullptr;
+        while (!heap->collectStep(std::chrono::microseconds(100)))
+            ;
+        auto& inc = rec->ended.back();
+        assert(inc.kind == GcEvent::Kind::Incremental && inc.phase == GcEvent::Phase::None);
+        assert(inc.marked.objects == 1 && inc.freed.objects == 1);
+
+        rec->ended.clear();
+        heap->fullCollect();
+        assert(rec->ended.back().kind == GcEvent::Kind::Full && rec->ended.back().marked.objects == 1);
+    }
+
+    auto pauses = heap->getPauseHistogram();
+    assert(pauses.count() >= 4);
+    assert(pauses.percentile(0.5) <= pauses.percentile(0.99) && pauses.percentile(0.99) <= pauses.max());
+    assert(pauses.max() <= pauses.total() && pauses.max().count() > 0);
+    heap->resetPauseHistogram();
+    assert(heap->getPauseHistogram().count() == 0);
+    gc_destroy_heap(heap);
+
+    details::PauseHistogram h;
+    for (int i = 1; i <= 100; i++)
+        h.record(std::chrono::microseconds(i));
+    auto p50 = h.percentile(0.5), p99 = h.percentile(0.99);
+    assert(p50 >= std::chrono::microseconds(50) && p50 <= std::chrono::microseconds(57));
+    assert(p99 >= std::chrono::microseconds(99) && p99 <= std::chrono::microseconds(100));
+    assert(h.max() == std::chrono::microseconds(100) && h.count() == 100);
+}
+
+void testTraceRecorder() {
+    auto count = [](const string& s, const char* what) {
+        size_t n = 0;
+        for (auto pos = s.find(what); pos != string::npos; pos = s.find(what, pos + 1))
+            n++;
+        return n;
+    };
+
+    auto* heap = gc_create_heap();
+    auto* rec = new details::TraceRecorder(8);
+    heap->setListener(rec);
+    {
+        gc_heap_scope scope(heap);
+        gc<int> keep = gc_new<int>(1);
+        heap->minorCollect();
+        auto json = rec->toJson();
+        assert(json.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0);
+        assert(json.substr(json.size() - 3) == "]}\n");
+        // The collection, its 4 phases and the live bytes before and after it.
+        assert(count(json, "\"ph\":\"X\"") == 5 && count(json, "\"ph\":\"C\"") == 2);
+        assert(count(json, "\"name\":\"minor collection\"") == 1);
+        assert(json.find("\"name\":\"mark\"") != string::npos);
+        assert(json.find("\"marked_objects\":1,") != string::npos);
+
+        for (int i = 0; i < 10; i++) {
+            gc_new<int>(i);
+            heap->fullCollect();
+        }
+        json = rec->toJson();
+        // Only the latest events are kept.
+        assert(count(json, "\"ph\":\"X\"") + count(json, "\"ph\":\"C\"") == 8);
+        assert(count(json, "\"name\":\"minor collection\"") == 0);
+        assert(json.find("\"name\":\"allocation rate\"") != string::npos);
+
+        rec->clear();
+        assert(count(rec->toJson(), "\"ph\":\"X\"") == 0);
+    }
+    gc_destroy_heap(heap);
+}
+
+void testAllocTrace() {
+    using details::AllocTraceEvent;
+    using Type = AllocTraceEvent::Type;
+    struct Node {
+        gc<Node> next;
+    };
+    const char* path = "tgc_test_trace.bin";
+
+    auto* heap = gc_create_heap();
+    assert(heap->startRecording(path));
+    uint64_t head, tail, headObj, tailObj;
+    {
+        gc_heap_scope scope(heap);
+        gc<Node> a = gc_new<Node>();
+        a->next = gc_new<Node>();
+        head = (uint64_t)(uintptr_t)&a;
+        tail = (uint64_t)(uintptr_t)&a->next;
+        headObj = (uint64_t)(uintptr_t)a.getMeta();
+        tailObj = (uint64_t)(uintptr_t)a->next.getMeta();
+        a->next = nullptr;
+        heap->minorCollect();
+        heap->collectStep(std::chrono::microseconds(250));
+    }
+    auto written = heap->stopRecording();
+    assert(written);
+    gc_destroy_heap(heap);
+
+    details::AllocTraceReader reader;
+    assert(reader.open(path));
+    AllocTraceEvent e;
+    vector<AllocTraceEvent> events;
+    while (reader.next(e))
+        events.push_back(e);
+    remove(path);
+
+    auto findEvent = [&](Type t, uint64_t ptr, uint64_t obj) {
+        return find_if(events.begin(), events.end(), [&](const AllocTraceEvent& e) {
+            return e.type == t && e.ptr == ptr && e.obj == obj;
+        });
+    };
+    assert(events[0].type == Type::Class && events[0].name.find("Node") != string::npos);
+    assert(events[1].type == Type::Alloc && events[1].obj == headObj && events[1].length == 1);
+    assert(events[1].size == sizeof(Node));
+    // The sub pointer is constructed in its owner, the root on the stack.
+    auto sub = findEvent(Type::NewPtr, tail, headObj);
+    assert(sub != events.end() && sub->offset == 0);
+    assert(findEvent(Type::NewPtr, head, 0) != events.end());
+    assert(findEvent(Type::Store, head, headObj) != events.end());
+    assert(findEvent(Type::Store, tail, tailObj) != events.end());
+    assert(findEvent(Type::Store, tail, 0) != events.end());
+    assert(findEvent(Type::DeletePtr, head, 0) != events.end());
+    assert(findEvent(Type::DeletePtr, tail, 0) == events.end());
+
+    vector<AllocTraceEvent::CollectKind> collects;
+    for (auto& e : events) {
+        if (e.type == Type::Collect)
+            collects.push_back(e.collect);
+    }
+    assert(collects.size() == 2 && collects[0] == AllocTraceEvent::CollectKind::Minor);
+    assert(collects[1] == AllocTraceEvent::CollectKind::Step);
+
+#ifdef __linux__
+    // Writes failing on a full disk are reported.
+    heap = gc_create_heap();
+    if (heap->startRecording("/dev/full")) {
+        {
+            gc_heap_scope scope(heap);
+            for (int i = 0; i < 10000; i++)
+                gc_new<Node>();
+        }
+        written = heap->stopRecording();
+        assert(!written);
+    }
+    gc_destroy_heap(heap);
+#endif
+}
+
+void testAdaptiveCondition() {
+    using details::GcCondition_Adaptive;
+    struct Node {
+        gc<Node> next;
+        char payload[48];
+    };
+
+    auto* heap = gc_create_heap();
+    {
+        gc_heap_scope scope(heap);
+        gc<Node> head;
+        // Allocates `cnt` nodes keeping every `keep`th one, returns the collections run meanwhile.
+        auto churn = [&](int cnt, int keep) {
+            auto before = heap->getHeapStats();
+            for (int i = 0; i < cnt; i++) {
+                auto n = gc_new<Node>();
+                if (i % keep == 0) {
+                    n->next = head;
+                    head = n;
+                }
+            }
+            auto after = heap->getHeapStats();
+            return after.minorCollections + after.fullCollections - before.minorCollections -
+                   before.fullCollections;
+        };
+
+        // A generous pause target lets the nursery grow.
+        auto* loose = new GcCondition_Adaptive(std::chrono::seconds(1));
+        heap->setGcCondition(loose);
+        auto initial = loose->getNurseryBytes();
+        assert(churn(200000, 10) > 0);
+        assert(loose->getNurseryBytes() > initial);
+        assert(loose->getSurvivalRate() > 0 && loose->getSurvivalRate() < 0.5);
+
+        // An unreachable one shrinks it to its minimum.
+        auto* tight = new GcCondition_Adaptive(std::chrono::microseconds(0));
+        heap->setGcCondition(tight);
+        assert(churn(200000, 1000) > 4);
+        assert(tight->getNurseryBytes() == GcCondition_Adaptive::MinNurseryBytes);
+
+        // Full collections once the survivors outgrow the threshold.
+        auto fulls = heap->getHeapStats().fullCollections;
+        for (int i = 0; i < 100 && heap->getHeapStats().fullCollections == fulls; i++)
+            churn(10000, 1);
+        assert(heap->getHeapStats().fullCollections > fulls);
+        assert(tight->getFullGcBytes() > GcCondition_Adaptive::MinFullGcBytes);
+    }
+    gc_destroy_heap(heap);
+}
+
+void testByteCondition() {
+    auto* heap = gc_create_heap();
+    auto* cond = new details::GcCondition_Bytes;
+    cond->allocatedBytesToGc = 4 << 20;
+    cond->oldGenBytesToFullGc = 1 << 20;
+    heap->setGcCondition(cond);
+    {
+        gc_heap_scope scope(heap);
+        // A few large buffers count as much as millions of small objects.
+        for (int i = 0; i < 3; i++)
+            gc_new_array<char>(1 << 20);
+        assert(heap->getAllocatedSinceGc() >= 3 << 20 && !cond->needMinorGc(heap));
+        gc_new_array<char>(1 << 20);
+        assert(cond->needMinorGc(heap));
+        heap->minorCollect();
+        assert(heap->getAllocatedSinceGc() == 0 && !cond->needMinorGc(heap));
+
+        // Promoted buffers trigger a full collection.
+        auto kept = gc_new_array<char>(2 << 20);
+        assert(!cond->needFullGc(heap));
+        while (heap->getHeapStats().old.bytes < (2 << 20))
+            heap->minorCollect();
+        assert(cond->oldGenBytes >= (2 << 20) && cond->needFullGc(heap));
+        auto fulls = heap->getHeapStats().fullCollections;
+        heap->collect();
+        assert(heap->getHeapStats().fullCollections == fulls + 1);
+    }
+    gc_destroy_heap(heap);
+}
+
+void testAutoCollect() {
+    // Constructors allocating their children, so allocations collect while their parents
+    // (and the first instance of the class) are under construction.
+    struct Tree {
+        gc<Tree> left, right;
+        int depth;
+        Tree(int d) : left(d ? gc_new<Tree>(d - 1) : nullptr), right(d ? gc_new<Tree>(d - 1) : nullptr), depth(d) {
+            gc_new_array<char>(100); // garbage
+        }
+        int count() const { return 1 + (left ? left->count() : 0) + (right ? right->count() : 0); }
+    };
+    auto build = [](details::Collector* heap) {
+        gc_heap_scope scope(heap);
+        auto trees = gc_new_array<Tree>(3, 10);
+        gc<Tree> tree = gc_new<Tree>(12);
+        for (int i = 0; i < 3; i++)
+            assert((&*trees)[i].depth == 10 && (&*trees)[i].count() == (1 << 11) - 1);
+        assert(tree->count() == (1 << 13) - 1);
+    };
+
+    auto* heap = gc_create_heap();
+    auto* cond = new details::GcCondition_Bytes;
+    cond->allocatedBytesToGc = 64 * 1024;
+    cond->oldGenBytesToFullGc = 256 * 1024;
+    heap->setGcCondition(cond);
+    build(heap);
+    auto s = heap->getHeapStats();
+    assert(s.minorCollections > 10 && s.fullCollections > 0);
+
+#ifdef TGC_MULTI_THREADED
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([&] { build(heap); });
+    heap->enterSafeRegion();
+    for (auto& t : threads)
+        t.join();
+    heap->leaveSafeRegion();
+#endif
+    gc_destroy_heap(heap);
+
+    // The first instance of a class collected while constructed, before its layout is complete.
+    struct Always : details::GcCondition {
+        bool needMinorGc(details::Collector* c) override { return true; }
+        bool needFullGc(details::Collector* c) override { return false; }
+    };
+    struct Leaf {
+        int value = 7;
+    };
+    struct Node {
+        gc<Leaf> a, b;
+        Node() {
+            a = gc_new<Leaf>();
+            b = gc_new<Leaf>();
+        }
+    };
+    heap = gc_create_heap();
+    heap->setGcCondition(new Always);
+    {
+        gc_heap_scope scope(heap);
+        gc<Node> n = gc_new<Node>();
+        assert(n->a->value == 7 && n->b->value == 7);
+        assert(heap->getHeapStats().minorCollections >= 3);
+    }
+    gc_destroy_heap(heap);
+}
+
+void testHeapLimit() {
+    using details::PageAllocator;
+    const size_t mb = 1 << 20;
+    auto* heap = gc_create_heap();
+    heap->setGcCondition(nullptr);
+    assert(heap->getHeapStats().headroom() == SIZE_MAX);
+    {
+        gc_heap_scope scope(heap);
+        heap->setHeapLimit(heap->getHeapStats().pages.reservedBytes + 4 * mb + 4 * PageAllocator::PageSize);
+        assert(heap->getHeapStats().headroom() == 4 * mb + 4 * PageAllocator::PageSize);
+
+        // Garbage is collected to make room.
+        for (int i = 0; i < 20; i++)
+            gc_new_array<char>(mb);
+        assert(heap->getHeapStats().minorCollections > 0);
+
+        // Live objects are not.
+        vector<gc<char>> cache;
+        try {
+            for (int i = 0; i < 20; i++)
+                cache.push_back(gc_new_array<char>(mb));
+            assert(false);
+        } catch (std::bad_alloc&) {
+        }
+        assert(cache.size() == 4);
+        assert(heap->getHeapStats().headroom() < mb);
+
+        // Until the handler drops them.
+        size_t handled = 0;
+        heap->setOutOfMemoryHandler([&](size_t size) {
+            assert(size > mb);
+            handled++;
+            cache.clear();
+        });
+        auto big = gc_new_array<char>(2 * mb);
+        assert(handled == 1 && cache.empty());
+        heap->setOutOfMemoryHandler(nullptr);
+    }
+    heap->setHeapLimit(0);
+    assert(heap->getHeapStats().headroom() == SIZE_MAX);
+    gc_destroy_heap(heap);
+
+    // The pages cached for reuse are given back before giving up.
+    heap = gc_create_heap();
+    heap->setGcCondition(nullptr);
+    {
+        gc_heap_scope scope(heap);
+        heap->setHeapLimit(2 * mb);
+        for (int i = 0; i < 20000; i++) {
+            gc_new<int>(i);
+            gc_new_vector<int>();
+        }
+        heap->fullCollect();
+        assert(heap->getHeapStats().pages.reservedBytes > 0);
+        gc_new_array<char>(1500 * 1024);
+    }
+    gc_destroy_heap(heap);
 }
 
 const int profilingCounts = 1024 * 1024;
@@ -358,8 +1429,61 @@ void profileAlloc() {
 #endif
 }
 
+void profileWriteBarrier() {
+#ifndef _DEBUG
+    struct Node {
+        gc<Node> next;
+    };
+
+    auto oldA = gc_new<Node>();
+    auto oldB = gc_new<Node>();
+    gc_collector()->minorCollect();
+    gc_collector()->minorCollect();
+    auto young = gc_new<Node>();
+    gc<Node> root;
+
+    int i = 0;
+    profiled("root store", [&] { root = (i++ & 1) ? oldA : oldB; });
+    profiled("old->old", [&] { oldA->next = (i++ & 1) ? oldA : oldB; });
+    profiled("young->old", [&] { young->next = (i++ & 1) ? oldA : oldB; });
+    profiled("old->young", [&] { oldA->next = (i++ & 1) ? young : oldB; });
+    gc_collector()->fullCollect();
+#endif
+}
+
+void profileParallelMark() {
+#ifndef _DEBUG
+    struct Node {
+        gc<Node> left, right;
+    };
+
+    auto build = [](int d, auto& self) -> gc<Node> {
+        auto n = gc_new<Node>();
+        if (d > 1) {
+            n->left = self(d - 1, self);
+            n->right = self(d - 1, self);
+        }
+        return n;
+    };
+    gc<Node> tree = build(20, build);
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        gc_collector()->setMarkThreads(threads);
+        gc_collector()->fullCollect();
+        auto start = std::chrono::high_resolution_clock::now();
+        gc_collector()->fullCollect();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        printf("[%2u markers] full collection: %fs\n", threads, elapsed.count());
+    }
+    gc_collector()->setMarkThreads(1);
+    tree = nullptr;
+    gc_collector()->fullCollect();
+#endif
+}
+
 int main() {
     profileAlloc();
+    profileWriteBarrier();
+    profileParallelMark();
     testCollection();
     testException();
 
@@ -383,6 +1507,26 @@ int main() {
     testDeque();
     testHashMap();
     testLambda();
+    testPageAllocator();
+    testNursery();
+    testRootTable();
+    testRememberedSet();
+    testDeclaredFields();
+    testIncrementalCollection();
+    testParallelMarking();
+    testBackgroundSweep();
+    testMultiThreaded();
+    testHeaps();
+    testMarkEpochs();
+    testHeapStats();
+    testClassStats();
+    testGcListener();
+    testTraceRecorder();
+    testAllocTrace();
+    testAdaptiveCondition();
+    testByteCondition();
+    testAutoCollect();
+    testHeapLimit();
 
     // there are some objects leaked from the upper tests, just dump them
     // out.